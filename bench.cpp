@@ -0,0 +1,262 @@
+#include "bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <thread>
+
+#include "model.h"
+#include "ourGL.h"
+#include "shader.h"
+#include "trace.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define BENCH_RUSAGE 1
+#endif
+
+namespace {
+
+double peak_memory_mb() {
+#ifdef BENCH_RUSAGE
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0); // bytes
+#else
+    return usage.ru_maxrss / 1024.0; // kilobytes
+#endif
+#else
+    return -1;
+#endif
+}
+
+/**
+ * result of one configuration, plain data so a child process can send it through a pipe
+*/
+struct Measurement
+{
+    double ms = 0; // fastest frame
+    long fragments = 0; // fragment shader calls of the last frame
+    RasterStats stats; // summed over the strips of the last frame
+    double peakMb = -1; // peak resident memory while measuring, negative when unknown
+};
+
+Measurement measure(const BenchConfig& config, const Model& model, const std::vector<mat4f>& transforms, const int size, const int nthreads) {
+    TRACE_SCOPE("bench configuration");
+    const int strip = (size + nthreads - 1) / nthreads;
+    std::vector<std::unique_ptr<RenderContext>> contexts;
+    for(int t = 0; t * strip < size; t++) {
+        contexts.emplace_back(new RenderContext(size, std::min(strip, size - t * strip), t * strip));
+        RenderContext& ctx = *contexts.back();
+        ctx.lookat(config.eye, config.center, config.up);
+        ctx.viewport(size / 8, size / 8, size * 3 / 4, size * 3 / 4);
+        ctx.projection(-1.0f / (config.eye - config.center).norm());
+        ctx.useHiZ = config.useHiZ;
+    }
+
+    Measurement ret;
+    for(int r = 0; r < std::max(1, config.repeat); r++) {
+        for(auto& ctx: contexts) {
+            ctx->clear();
+            ctx->stats = RasterStats();
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> pool;
+        for(auto& ctx: contexts) {
+            pool.emplace_back([&, c = ctx.get()]() {
+                for(const mat4f& transform: transforms) {
+                    render_model(*c, model, transform);
+                }
+            });
+        }
+        for(auto& t: pool) {
+            t.join();
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        ret.ms = r == 0 ? ms : std::min(ret.ms, ms);
+        ret.fragments = 0;
+        ret.stats = RasterStats();
+        for(auto& ctx: contexts) {
+            ret.fragments += ctx->stats.invocations;
+            ret.stats.triangles += ctx->stats.triangles;
+            ret.stats.trianglesCulled += ctx->stats.trianglesCulled;
+            ret.stats.blocks += ctx->stats.blocks;
+            ret.stats.blocksCulled += ctx->stats.blocksCulled;
+        }
+    }
+    return ret;
+}
+
+/**
+ * measure() in a forked child, whose peak resident memory starts at what it shares with the parent
+ * (mostly the model) and so describes this configuration alone. The zones a child traces are lost,
+ * so with tracing on, or without fork, it measures in process and leaves the peak unknown.
+*/
+Measurement measure_isolated(const BenchConfig& config, const Model& model, const std::vector<mat4f>& transforms, const int size, const int nthreads) {
+#ifdef BENCH_RUSAGE
+    int fds[2];
+    if(trace_level.load() == TRACE_OFF && pipe(fds) == 0) {
+        std::fflush(stdout);
+        pid_t pid = fork();
+        if(pid == 0) {
+            close(fds[0]);
+            Measurement m = measure(config, model, transforms, size, nthreads);
+            m.peakMb = peak_memory_mb();
+            bool ok = write(fds[1], &m, sizeof(m)) == sizeof(m);
+            _exit(ok ? 0 : 1);
+        }
+        close(fds[1]);
+        Measurement m;
+        bool ok = pid > 0 && read(fds[0], &m, sizeof(m)) == sizeof(m);
+        close(fds[0]);
+        if(pid > 0) waitpid(pid, nullptr, 0);
+        if(ok) return m;
+    }
+#endif
+    return measure(config, model, transforms, size, nthreads);
+}
+
+// the generic template code of geometry.h, before the float specializations, used as reference
+vec4f generic_mul(const mat4f& m, const vec4f& v) {
+    vec4f ret;
+    for(int i = 4; i--; ) {
+        float sum = 0;
+        for(int j = 4; j--; sum += m[i][j] * v[j]);
+        ret[i] = sum;
+    }
+    return ret;
+}
+
+mat4f generic_mul(const mat4f& a, const mat4f& b) {
+    mat4f ret;
+    for(int i = 4; i--; ) {
+        for(int j = 4; j--; ) {
+            float sum = 0;
+            for(int k = 4; k--; sum += a[i][k] * b[k][j]);
+            ret[i][j] = sum;
+        }
+    }
+    return ret;
+}
+
+mat4f generic_invert_transpose(const mat4f& m) {
+    mat4f ret;
+    for(int i = 4; i--; ) {
+        for(int j = 4; j--; ret[i][j] = dt<float, 3>::det(m.get_minor(i, j)) * ((i + j) % 2 ? -1 : 1));
+    }
+    float det = 0;
+    for(int i = 4; i--; det += ret[0][i] * m[0][i]);
+    return ret / det;
+}
+
+template<int n> float max_difference(const mat<float, n, n>& a, const mat<float, n, n>& b) {
+    float ret = 0;
+    for(int i = n; i--; ) {
+        for(int j = n; j--; ret = std::max(ret, std::abs(a[i][j] - b[i][j])));
+    }
+    return ret;
+}
+
+float max_difference(const vec4f& a, const vec4f& b) {
+    float ret = 0;
+    for(int i = 4; i--; ret = std::max(ret, std::abs(a[i] - b[i])));
+    return ret;
+}
+
+/**
+ * ns per call of op over the inputs, the results are kept in out so no call is optimized away
+*/
+template<class Out, class Op> double ns_per_op(const int iterations, std::vector<Out>& out, Op op) {
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < iterations; i++) {
+        out[i % out.size()] = op(i % out.size());
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+}
+
+template<class Out, class Generic, class Fast> void compare_op(const char* name, const int iterations, const std::size_t count, Generic generic, Fast fast) {
+    std::vector<Out> reference(count), result(count);
+    const double genericNs = ns_per_op(iterations, reference, generic);
+    const double fastNs = ns_per_op(iterations, result, fast);
+    float difference = 0;
+    for(std::size_t i = 0; i < count; i++) {
+        difference = std::max(difference, max_difference(reference[i], result[i]));
+    }
+    std::printf("%-26s %10.2f %10.2f %8.2fx %14g\n", name, genericNs, fastNs, genericNs / fastNs, difference);
+    std::fflush(stdout);
+}
+
+}
+
+bool run_benchmark(const BenchConfig& config) {
+    Model model(config.model);
+    if(!model.nfaces()) {
+        std::cerr << "can't load " << config.model << std::endl;
+        return false;
+    }
+    const int grid = (int)std::ceil(std::sqrt((double)std::max(1, config.instances)));
+    const float s = 2.0f / grid;
+    std::vector<mat4f> transforms;
+    for(int i = 0; i < config.instances; i++) {
+        const int gx = i % grid, gy = i / grid;
+        transforms.push_back({{{s, 0, 0, -1 + (gx + 0.5f) * s}, {0, s, 0, -1 + (gy + 0.5f) * s}, {0, 0, s, 0}, {0, 0, 0, 1}}});
+    }
+    const double triangles = (double)model.nfaces() * config.instances;
+
+    // the single thread run comes first, it is the reference of the parallel efficiency
+    std::vector<int> threads = config.threads;
+    std::stable_partition(threads.begin(), threads.end(), [](const int n) { return n <= 1; });
+
+    std::printf("%8s %8s %10s %12s %12s %10s %10s %9s %9s\n", "size", "threads", "ms", "Mtris/s", "Mfrags/s", "peak MB", "efficiency",
+        "hiz tri%", "hiz blk%");
+    for(int size: config.sizes) {
+        double singleMs = 0; // 0 until measured, efficiency is n/a without it
+        for(int nthreads: threads) {
+            nthreads = std::max(1, std::min(nthreads, size));
+            Measurement m = measure_isolated(config, model, transforms, size, nthreads);
+            if(nthreads == 1) singleMs = m.ms;
+            char peak[16] = "n/a", efficiency[16] = "n/a";
+            if(m.peakMb >= 0) std::snprintf(peak, sizeof(peak), "%.1f", m.peakMb);
+            if(singleMs > 0) std::snprintf(efficiency, sizeof(efficiency), "%.2f", singleMs / (nthreads * m.ms));
+            std::printf("%8d %8d %10.1f %12.2f %12.2f %10s %10s %9.1f %9.1f\n", size, nthreads, m.ms, triangles / m.ms / 1e3,
+                m.fragments / m.ms / 1e3, peak, efficiency,
+                100.0 * m.stats.trianglesCulled / std::max(1L, m.stats.triangles), 100.0 * m.stats.blocksCulled / std::max(1L, m.stats.blocks));
+            std::fflush(stdout);
+        }
+    }
+    return true;
+}
+
+void run_math_benchmark(const int iterations) {
+    constexpr std::size_t count = 256; // inputs cycled through, small enough to stay in cache
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> uniform(-1, 1);
+    std::vector<mat4f> m4(count);
+    std::vector<vec4f> v4(count);
+    for(std::size_t k = 0; k < count; k++) {
+        for(int i = 0; i < 4; i++) {
+            for(int j = 0; j < 4; j++) {
+                m4[k][i][j] = uniform(random) + (i == j ? 2 : 0); // diagonally dominant, so invertible
+            }
+            v4[k][i] = uniform(random);
+        }
+    }
+
+    std::printf("%-26s %10s %10s %9s %14s\n", "operation", "generic ns", "fast ns", "speedup", "max difference");
+    compare_op<vec4f>("mat4f * vec4f", iterations, count,
+        [&](const std::size_t k) { return generic_mul(m4[k], v4[k]); },
+        [&](const std::size_t k) { return m4[k] * v4[k]; });
+    compare_op<mat4f>("mat4f * mat4f", iterations, count,
+        [&](const std::size_t k) { return generic_mul(m4[k], m4[(k + 1) % count]); },
+        [&](const std::size_t k) { return m4[k] * m4[(k + 1) % count]; });
+    compare_op<mat4f>("mat4f::invert_transpose", iterations, count,
+        [&](const std::size_t k) { return generic_invert_transpose(m4[k]); },
+        [&](const std::size_t k) { return m4[k].invert_transpose(); });
+}
@@ -0,0 +1,44 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <string>
+#include <vector>
+
+#include "geometry.h"
+
+struct BenchConfig
+{
+    std::string model; // obj file, e.g. from write_synthetic_model
+    int instances = 1; // copies of the model, scaled onto a square grid covering the same area
+    std::vector<int> sizes = {512, 1024, 2048}; // square frame sizes
+    std::vector<int> threads = {1, 2, 4};
+    int repeat = 3; // frames per configuration, the fastest one is reported
+    bool useHiZ = true; // hierarchical z rejection, see RenderContext::useHiZ
+    vec3f eye;
+    vec3f center;
+    vec3f up;
+};
+
+/**
+ * Render the model at every frame size with every thread count and print one line per configuration:
+ * frame time, submitted triangles/s, shaded fragments/s, peak resident memory, parallel efficiency
+ * and the share of triangles and blocks rejected by the hierarchical z.
+ * Every configuration runs in its own child process, so its peak memory is its own: the loaded model
+ * plus its targets. With tracing on it runs in process instead and the peak is n/a.
+ * The efficiency is against the single thread run of the same size, which is measured first whenever
+ * 1 is in threads; without it the efficiency is n/a.
+ * With n threads the frame is cut into n horizontal strips, each rendered by its own thread into its
+ * own RenderContext; every thread vertex shades the whole model, so efficiency shows that overhead too.
+ * @return false when the model can't be loaded
+*/
+bool run_benchmark(const BenchConfig& config);
+
+/**
+ * Time the float matrix fast paths of geometry.h against the generic template code they specialize,
+ * over random well conditioned inputs, and print ns per operation for both plus the largest
+ * difference between their results.
+ * @param iterations operations timed per row
+*/
+void run_math_benchmark(const int iterations = 1 << 22);
+
+#endif
@@ -4,6 +4,12 @@
 #include<cassert>
 #include<cmath>
 #include<iostream>
+#include<type_traits>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include<xmmintrin.h>
+#define GEOMETRY_SSE 1
+#endif
 
 //------------------------------- define some vector --------------------------------------------
 
@@ -46,21 +52,28 @@ template<class T, int n> vec<T, n> operator-(const vec<T, n>& lhs, const vec<T,
     return ret;
 }
 
-template<class T, int n> vec<T, n> operator*(const double rhs, const vec<T, n>& lhs) {
+template<class S> using enable_if_scalar_t = typename std::enable_if<std::is_arithmetic<S>::value>::type;
+
+// Float vectors are scaled by float scalars in float, anything else goes through double as before.
+// Both round the same: the product of two floats is exact in double and a double quotient of floats
+// rounds to the correctly rounded float one, so only the float/double conversions are saved.
+template<class T, class S> using scale_t = typename std::conditional<std::is_same<T, float>::value && std::is_same<S, float>::value, float, double>::type;
+
+template<class T, int n, class S, class = enable_if_scalar_t<S>> vec<T, n> operator*(const S rhs, const vec<T, n>& lhs) {
     vec<T, n> ret = lhs;
-    for(int i = n; i--; ret[i] *= rhs);
+    for(int i = n; i--; ret[i] *= static_cast<scale_t<T, S>>(rhs));
     return ret;
 }
 
-template<class T, int n> vec<T, n> operator*(const vec<T, n>& lhs, const double rhs) {
+template<class T, int n, class S, class = enable_if_scalar_t<S>> vec<T, n> operator*(const vec<T, n>& lhs, const S rhs) {
     vec<T, n> ret = lhs;
-    for(int i = n; i--; ret[i] *= rhs);
+    for(int i = n; i--; ret[i] *= static_cast<scale_t<T, S>>(rhs));
     return ret;
 }
 
-template<class T, int n> vec<T, n> operator/(const vec<T, n>& lhs, const double rhs) {
+template<class T, int n, class S, class = enable_if_scalar_t<S>> vec<T, n> operator/(const vec<T, n>& lhs, const S rhs) {
     vec<T, n> ret = lhs;
-    for(int i = n; i--; ret[i] /= rhs);
+    for(int i = n; i--; ret[i] /= static_cast<scale_t<T, S>>(rhs));
     return ret;
 }
 
@@ -143,6 +156,88 @@ template<class T> struct vec<T, 3>
 };
 
 
+/**
+ * vec4f is the workhorse of the pipeline (clip coordinates, homogeneous points),
+ * so it gets 16-byte aligned storage and SSE arithmetic. Layout and API stay the
+ * same as the generic vec<T, 4>.
+*/
+template<> struct alignas(16) vec<float, 4>
+{
+    vec() = default;
+    float& operator[](const int i) {
+        assert(i>=0 && i < 4);
+        return data[i];
+    }
+    float operator[](const int i) const {
+        assert(i>=0 && i < 4);
+        return data[i];
+    }
+    double norm2() const;
+    double norm() const {
+        return std::sqrt(norm2());
+    }
+    float data[4] = {};
+};
+
+inline float operator*(const vec<float, 4>& lhs, const vec<float, 4>& rhs) {
+#ifdef GEOMETRY_SSE
+    alignas(16) float m[4];
+    _mm_store_ps(m, _mm_mul_ps(_mm_load_ps(lhs.data), _mm_load_ps(rhs.data)));
+    return m[3] + m[2] + m[1] + m[0]; // summed in the order of the generic dot
+#else
+    return lhs[3]*rhs[3] + lhs[2]*rhs[2] + lhs[1]*rhs[1] + lhs[0]*rhs[0];
+#endif
+}
+
+inline vec<float, 4> operator+(const vec<float, 4>& lhs, const vec<float, 4>& rhs) {
+    vec<float, 4> ret;
+#ifdef GEOMETRY_SSE
+    _mm_store_ps(ret.data, _mm_add_ps(_mm_load_ps(lhs.data), _mm_load_ps(rhs.data)));
+#else
+    for(int i = 4; i--; ret[i] = lhs[i] + rhs[i]);
+#endif
+    return ret;
+}
+
+inline vec<float, 4> operator-(const vec<float, 4>& lhs, const vec<float, 4>& rhs) {
+    vec<float, 4> ret;
+#ifdef GEOMETRY_SSE
+    _mm_store_ps(ret.data, _mm_sub_ps(_mm_load_ps(lhs.data), _mm_load_ps(rhs.data)));
+#else
+    for(int i = 4; i--; ret[i] = lhs[i] - rhs[i]);
+#endif
+    return ret;
+}
+
+inline vec<float, 4> operator*(const vec<float, 4>& lhs, const float rhs) {
+    vec<float, 4> ret;
+#ifdef GEOMETRY_SSE
+    _mm_store_ps(ret.data, _mm_mul_ps(_mm_load_ps(lhs.data), _mm_set1_ps(rhs)));
+#else
+    for(int i = 4; i--; ret[i] = lhs[i] * rhs);
+#endif
+    return ret;
+}
+
+inline vec<float, 4> operator*(const float lhs, const vec<float, 4>& rhs) {
+    return rhs * lhs;
+}
+
+inline vec<float, 4> operator/(const vec<float, 4>& lhs, const float rhs) {
+    vec<float, 4> ret;
+#ifdef GEOMETRY_SSE
+    _mm_store_ps(ret.data, _mm_div_ps(_mm_load_ps(lhs.data), _mm_set1_ps(rhs)));
+#else
+    for(int i = 4; i--; ret[i] = lhs[i] / rhs);
+#endif
+    return ret;
+}
+
+inline double vec<float, 4>::norm2() const {
+    return (*this) * (*this);
+}
+
+
 typedef vec<float, 2> vec2f;
 typedef vec<float, 3> vec3f;
 typedef vec<float, 4> vec4f;
@@ -246,13 +341,13 @@ template<class T, int R1,int C1,int C2>mat<T, R1,C2> operator*(const mat<T, R1,C
     return result;
 }
 
-template<class T, int nrows,int ncols>mat<T, nrows,ncols> operator*(const mat<T, nrows,ncols>& lhs, const double& val) {
+template<class T, int nrows,int ncols, class S, class = enable_if_scalar_t<S>>mat<T, nrows,ncols> operator*(const mat<T, nrows,ncols>& lhs, const S& val) {
     mat<T, nrows,ncols> result;
     for (int i=nrows; i--; result[i] = lhs[i]*val);
     return result;
 }
 
-template<class T, int nrows,int ncols>mat<T, nrows,ncols> operator/(const mat<T, nrows,ncols>& lhs, const double& val) {
+template<class T, int nrows,int ncols, class S, class = enable_if_scalar_t<S>>mat<T, nrows,ncols> operator/(const mat<T, nrows,ncols>& lhs, const S& val) {
     mat<T, nrows,ncols> result;
     for (int i=nrows; i--; result[i] = lhs[i]/val);
     return result;
@@ -305,4 +400,143 @@ typedef mat<int, 2, 2> mat2i;
 
 
 
-#endif
\ No newline at end of file
+
+//------------------------- float 4x4 fast paths ---------------------------------------------
+// closed-form determinant/inverse instead of the recursive cofactor expansion of dt<T, n>,
+// and SSE multiply/transpose for mat4f. adjugate() keeps its generic meaning (cofactor matrix).
+// Every path sums in the order of the generic code and accumulates in double where it does, so
+// the results are bit for bit those of the generic templates (checked by --bench-math).
+// mat3f stays generic: to match it a closed form has to work in double, and inlined at -O3 the
+// generic code is as fast as that closed form, SSE included.
+
+inline vec<float, 4> operator*(const mat<float, 4, 4>& lhs, const vec<float, 4>& rhs) {
+    vec<float, 4> ret;
+#ifdef GEOMETRY_SSE
+    __m128 c0 = _mm_load_ps(lhs.rows[0].data);
+    __m128 c1 = _mm_load_ps(lhs.rows[1].data);
+    __m128 c2 = _mm_load_ps(lhs.rows[2].data);
+    __m128 c3 = _mm_load_ps(lhs.rows[3].data);
+    _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+    __m128 v = _mm_load_ps(rhs.data);
+    __m128 r = _mm_mul_ps(c3, _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3)));
+    r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2))));
+    r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1))));
+    r = _mm_add_ps(r, _mm_mul_ps(c0, _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0))));
+    _mm_store_ps(ret.data, r);
+#else
+    for (int i=4; i--; ret[i]=lhs[i]*rhs);
+#endif
+    return ret;
+}
+
+inline mat<float, 4, 4> operator*(const mat<float, 4, 4>& lhs, const mat<float, 4, 4>& rhs) {
+    mat<float, 4, 4> result;
+#ifdef GEOMETRY_SSE
+    __m128 b0 = _mm_load_ps(rhs.rows[0].data);
+    __m128 b1 = _mm_load_ps(rhs.rows[1].data);
+    __m128 b2 = _mm_load_ps(rhs.rows[2].data);
+    __m128 b3 = _mm_load_ps(rhs.rows[3].data);
+    for (int i=0; i<4; i++) {
+        const float* a = lhs.rows[i].data;
+        __m128 r = _mm_mul_ps(_mm_set1_ps(a[3]), b3);
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a[2]), b2));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a[1]), b1));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a[0]), b0));
+        _mm_store_ps(result.rows[i].data, r);
+    }
+#else
+    for (int i=4; i--; )
+        for (int j=4; j--; result[i][j]=lhs[i]*rhs.col(j));
+#endif
+    return result;
+}
+
+template<> inline mat<float, 4, 4> mat<float, 4, 4>::transpose() const {
+    mat<float, 4, 4> ret;
+#ifdef GEOMETRY_SSE
+    __m128 r0 = _mm_load_ps(rows[0].data);
+    __m128 r1 = _mm_load_ps(rows[1].data);
+    __m128 r2 = _mm_load_ps(rows[2].data);
+    __m128 r3 = _mm_load_ps(rows[3].data);
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    _mm_store_ps(ret.rows[0].data, r0);
+    _mm_store_ps(ret.rows[1].data, r1);
+    _mm_store_ps(ret.rows[2].data, r2);
+    _mm_store_ps(ret.rows[3].data, r3);
+#else
+    for (int i=4; i--; ret[i]=this->col(i));
+#endif
+    return ret;
+}
+
+/**
+ * Cofactor matrix of a 4x4 matrix through its 2x2 sub-determinants. The cofactors are
+ * accumulated in double and rounded to float once, like the recursive dt<T, n> expansion,
+ * and the determinant is the float dot of the first rows as in the generic invert_transpose.
+*/
+inline mat<float, 4, 4> cofactor4(const mat<float, 4, 4>& m, float& det) {
+    const float* a = m.rows[0].data;
+    const float* b = m.rows[1].data;
+    const float* c = m.rows[2].data;
+    const float* d = m.rows[3].data;
+    // 2x2 determinants of the upper two rows and of the lower two rows, products of floats are exact in double
+    double s0 = (double)a[0]*b[1] - (double)b[0]*a[1];
+    double s1 = (double)a[0]*b[2] - (double)b[0]*a[2];
+    double s2 = (double)a[0]*b[3] - (double)b[0]*a[3];
+    double s3 = (double)a[1]*b[2] - (double)b[1]*a[2];
+    double s4 = (double)a[1]*b[3] - (double)b[1]*a[3];
+    double s5 = (double)a[2]*b[3] - (double)b[2]*a[3];
+    double c5 = (double)c[2]*d[3] - (double)d[2]*c[3];
+    double c4 = (double)c[1]*d[3] - (double)d[1]*c[3];
+    double c3 = (double)c[1]*d[2] - (double)d[1]*c[2];
+    double c2 = (double)c[0]*d[3] - (double)d[0]*c[3];
+    double c1 = (double)c[0]*d[2] - (double)d[0]*c[2];
+    double c0 = (double)c[0]*d[1] - (double)d[0]*c[1];
+    mat<float, 4, 4> ret = {
+        {
+            {(float)( b[1]*c5 - b[2]*c4 + b[3]*c3), (float)(-b[0]*c5 + b[2]*c2 - b[3]*c1), (float)( b[0]*c4 - b[1]*c2 + b[3]*c0), (float)(-b[0]*c3 + b[1]*c1 - b[2]*c0)},
+            {(float)(-a[1]*c5 + a[2]*c4 - a[3]*c3), (float)( a[0]*c5 - a[2]*c2 + a[3]*c1), (float)(-a[0]*c4 + a[1]*c2 - a[3]*c0), (float)( a[0]*c3 - a[1]*c1 + a[2]*c0)},
+            {(float)( d[1]*s5 - d[2]*s4 + d[3]*s3), (float)(-d[0]*s5 + d[2]*s2 - d[3]*s1), (float)( d[0]*s4 - d[1]*s2 + d[3]*s0), (float)(-d[0]*s3 + d[1]*s1 - d[2]*s0)},
+            {(float)(-c[1]*s5 + c[2]*s4 - c[3]*s3), (float)( c[0]*s5 - c[2]*s2 + c[3]*s1), (float)(-c[0]*s4 + c[1]*s2 - c[3]*s0), (float)( c[0]*s3 - c[1]*s1 + c[2]*s0)}
+        }
+    };
+    det = ret[0] * m.rows[0];
+    return ret;
+}
+
+template<> inline double mat<float, 4, 4>::det() const {
+    const float* a = rows[0].data;
+    const float* b = rows[1].data;
+    const float* c = rows[2].data;
+    const float* d = rows[3].data;
+    double s0 = (double)a[0]*b[1] - (double)b[0]*a[1];
+    double s1 = (double)a[0]*b[2] - (double)b[0]*a[2];
+    double s2 = (double)a[0]*b[3] - (double)b[0]*a[3];
+    double s3 = (double)a[1]*b[2] - (double)b[1]*a[2];
+    double s4 = (double)a[1]*b[3] - (double)b[1]*a[3];
+    double s5 = (double)a[2]*b[3] - (double)b[2]*a[3];
+    double c5 = (double)c[2]*d[3] - (double)d[2]*c[3];
+    double c4 = (double)c[1]*d[3] - (double)d[1]*c[3];
+    double c3 = (double)c[1]*d[2] - (double)d[1]*c[2];
+    double c2 = (double)c[0]*d[3] - (double)d[0]*c[3];
+    double c1 = (double)c[0]*d[2] - (double)d[0]*c[2];
+    double c0 = (double)c[0]*d[1] - (double)d[0]*c[1];
+    return s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0;
+}
+
+template<> inline mat<float, 4, 4> mat<float, 4, 4>::adjugate() const {
+    float det;
+    return cofactor4(*this, det);
+}
+
+template<> inline mat<float, 4, 4> mat<float, 4, 4>::invert_transpose() const {
+    float det;
+    mat<float, 4, 4> ret = cofactor4(*this, det);
+    return ret / det; // divided in double, like the generic version
+}
+
+template<> inline mat<float, 4, 4> mat<float, 4, 4>::invert() const {
+    return invert_transpose().transpose();
+}
+
+#endif
@@ -0,0 +1,126 @@
+#include "incremental.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "trace.h"
+
+IncrementalRenderer::IncrementalRenderer(RenderContext& ctx, const DrawFunc& draw, const int tileSize)
+    :ctx_(ctx), draw_(draw), dirty_(), draws_(), bounds_(), footprints_(), tileDraws_(), changed_() {
+    dirty_.reset(ctx.image.get_width(), ctx.image.get_height(), (tileSize + hiz_tile - 1) / hiz_tile * hiz_tile);
+    tileDraws_.resize(dirty_.tiles.size());
+}
+
+int IncrementalRenderer::add(const Draw& d) {
+    draws_.push_back(d);
+    bounds_.push_back(model_bounds(*d.model));
+    footprints_.emplace_back();
+    changed_.push_back(true);
+    return draws_.size() - 1;
+}
+
+void IncrementalRenderer::update(const int id, const Draw& d) {
+    draws_[id] = d;
+    changed_[id] = true;
+}
+
+IncrementalRenderer::Footprint IncrementalRenderer::footprint(const int id) const {
+    const AABB& box = bounds_[id];
+    Footprint f;
+    if(box.empty()) return f;
+    const mat4f clip = ctx_.Projection * ctx_.ModelView * draws_[id].transform;
+    float xmin = std::numeric_limits<float>::max(), xmax = -std::numeric_limits<float>::max();
+    float ymin = xmin, ymax = xmax;
+    for(int i = 0; i < 8; i++) {
+        vec3f corner((i & 1) ? box.max.x : box.min.x, (i & 2) ? box.max.y : box.min.y, (i & 4) ? box.max.z : box.min.z);
+        vec4f c = clip * embed<float, 4>(corner);
+        if(!(c[3] > 0)) { // crosses the eye plane, assume it covers the screen
+            f.x1 = dirty_.width - 1;
+            f.y1 = dirty_.height - 1;
+            return f;
+        }
+        vec4f p = ctx_.Viewport * c;
+        xmin = std::min(xmin, p[0] / p[3]);
+        xmax = std::max(xmax, p[0] / p[3]);
+        ymin = std::min(ymin, p[1] / p[3]);
+        ymax = std::max(ymax, p[1] / p[3]);
+    }
+    const int width = ctx_.image.get_width(), height = ctx_.image.get_height();
+    int x0 = std::max(0, (int)std::floor(xmin)), x1 = std::min(width - 1, (int)std::floor(xmax) + 1);
+    int y0 = std::max(0, (int)std::floor(ymin)), y1 = std::min(height - 1, (int)std::floor(ymax) + 1);
+    if(x0 > x1 || y0 > y1) return f;
+    f.x0 = x0 / dirty_.size;
+    f.x1 = x1 / dirty_.size;
+    f.y0 = y0 / dirty_.size;
+    f.y1 = y1 / dirty_.size;
+    return f;
+}
+
+void IncrementalRenderer::mark(const Footprint& f) {
+    for(int ty = f.y0; ty <= f.y1; ty++) {
+        for(int tx = f.x0; tx <= f.x1; tx++) {
+            dirty_.tiles[tx + ty * dirty_.width] = 1;
+        }
+    }
+}
+
+void IncrementalRenderer::move(const int id, const Footprint& f) {
+    const Footprint& old = footprints_[id];
+    for(int ty = old.y0; ty <= old.y1; ty++) {
+        for(int tx = old.x0; tx <= old.x1; tx++) {
+            std::vector<int>& list = tileDraws_[tx + ty * dirty_.width];
+            list.erase(std::lower_bound(list.begin(), list.end(), id));
+        }
+    }
+    for(int ty = f.y0; ty <= f.y1; ty++) {
+        for(int tx = f.x0; tx <= f.x1; tx++) {
+            std::vector<int>& list = tileDraws_[tx + ty * dirty_.width];
+            list.insert(std::lower_bound(list.begin(), list.end(), id), id);
+        }
+    }
+    footprints_[id] = f;
+}
+
+IncrementalStats IncrementalRenderer::render() {
+    TRACE_SCOPE("incremental render");
+    IncrementalStats stats;
+    stats.tiles = dirty_.width * dirty_.height;
+    stats.draws = draws_.size();
+    std::fill(dirty_.tiles.begin(), dirty_.tiles.end(), 0);
+
+    // invalidate the old and the new footprint of every changed draw
+    for(std::size_t i = 0; i < draws_.size(); i++) {
+        if(!changed_[i]) continue;
+        mark(footprints_[i]);
+        move(i, footprint(i));
+        mark(footprints_[i]);
+        changed_[i] = false;
+    }
+    if(first_) {
+        std::fill(dirty_.tiles.begin(), dirty_.tiles.end(), 1);
+    }
+    std::vector<bool> redraw(draws_.size(), false);
+    for(int ty = 0; ty < dirty_.height; ty++) {
+        for(int tx = 0; tx < dirty_.width; tx++) {
+            if(!dirty_.tiles[tx + ty * dirty_.width]) continue;
+            stats.dirtyTiles++;
+            ctx_.clear_tile(tx * dirty_.size, ty * dirty_.size, (tx + 1) * dirty_.size, (ty + 1) * dirty_.size);
+            for(int id: tileDraws_[tx + ty * dirty_.width]) {
+                redraw[id] = true;
+            }
+        }
+    }
+    if(!stats.dirtyTiles) return stats;
+
+    // redraw, in the original order, every draw listed in a dirty tile
+    ctx_.mask = first_ ? nullptr : &dirty_;
+    for(std::size_t i = 0; i < draws_.size(); i++) {
+        if(!redraw[i]) continue;
+        stats.redrawnDraws++;
+        draw_(ctx_, draws_[i]);
+    }
+    ctx_.mask = nullptr;
+    first_ = false;
+    return stats;
+}
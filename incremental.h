@@ -0,0 +1,78 @@
+#ifndef __INCREMENTAL_H__
+#define __INCREMENTAL_H__
+
+#include <functional>
+#include <vector>
+
+#include "geometry.h"
+#include "model.h"
+#include "ourGL.h"
+#include "scene.h"
+
+/**
+ * one draw call of an incrementally rendered frame, the transform and the light are its uniforms
+*/
+struct Draw
+{
+    const Model* model;
+    mat4f transform; // model to world
+    vec3f light; // light direction in world coordinates
+};
+
+/**
+ * what the last IncrementalRenderer::render() redrew
+*/
+struct IncrementalStats
+{
+    int tiles = 0; // tiles of the frame
+    int dirtyTiles = 0; // tiles cleared and redrawn
+    int draws = 0; // draws of the frame
+    int redrawnDraws = 0; // draws listed in a dirty tile, submitted again
+    double redrawnFraction() const { return tiles ? (double)dirtyTiles / tiles : 0; }
+};
+
+/**
+ * Keeps the previous frame in the context and redraws only what changed.
+ * The screen is cut into tiles; every draw remembers the tiles its projected bounding box
+ * covers and every tile the draws covering it. When a draw changes, the union of its old and
+ * new footprints is cleared and redrawn, with the draws overlapping it submitted again in
+ * their original order under a tile mask, so the result equals a full redraw.
+*/
+class IncrementalRenderer
+{
+public:
+    using DrawFunc = std::function<void(RenderContext&, const Draw&)>;
+
+    /**
+     * @param draw submits one draw to the context (vertex and fragment shading)
+     * @param tileSize side of a tile in pixels, rounded up to a multiple of hiz_tile
+    */
+    IncrementalRenderer(RenderContext& ctx, const DrawFunc& draw, const int tileSize = 32);
+
+    int add(const Draw& d); // returns the id of the draw
+    void update(const int id, const Draw& d); // change transform or light, takes effect at the next render()
+    const Draw& get(const int id) const { return draws_[id]; }
+
+    IncrementalStats render(); // the first call draws the whole frame
+
+private:
+    struct Footprint
+    {
+        int x0 = 0, y0 = 0, x1 = -1, y1 = -1; // inclusive tile range, empty when x1 < x0
+    };
+    Footprint footprint(const int id) const; // tiles the projected bounds of the draw cover
+    void mark(const Footprint& f); // select the tiles of f in dirty_
+    void move(const int id, const Footprint& f); // update the tile lists for the new footprint of a draw
+
+    RenderContext& ctx_;
+    DrawFunc draw_;
+    TileMask dirty_;
+    std::vector<Draw> draws_;
+    std::vector<AABB> bounds_; // model space bounds per draw
+    std::vector<Footprint> footprints_; // footprint the draw had when last rendered
+    std::vector<std::vector<int>> tileDraws_; // per tile, ids of the draws whose footprint covers it, ascending
+    std::vector<bool> changed_;
+    bool first_ = true;
+};
+
+#endif
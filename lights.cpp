@@ -0,0 +1,95 @@
+#include "lights.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "ourGL.h"
+#include "trace.h"
+
+void LightSet::build(const RenderContext& ctx, const std::vector<Light>& worldLights, const float wmin, const float wmax) {
+    TRACE_SCOPE("build light grid");
+    lights.clear();
+    for(Light l: worldLights) {
+        l.position = proj<float, 3>(ctx.ModelView * embed<float, 4>(l.position));
+        l.direction = proj<float, 3>(ctx.ModelView * embed<float, 4>(l.direction, 0.0f)).normalize();
+        lights.push_back(l);
+    }
+    minW = wmin;
+    maxW = std::max(wmax, wmin + 1e-3f);
+    const int imageWidth = ctx.image.get_width(), imageHeight = ctx.image.get_height();
+    width = (imageWidth + tile - 1) / tile;
+    height = (imageHeight + tile - 1) / tile;
+    offsets.assign(width * height * slices + 1, 0);
+    indices.clear();
+    if(!tiled) return;
+
+    // cell range of every light from the screen box and the w range of the cube around its sphere
+    struct Range
+    {
+        int x0, y0, s0, x1, y1, s1;
+    };
+    std::vector<Range> ranges(lights.size());
+    const mat4f toScreen = ctx.Viewport * ctx.Projection;
+    for(std::size_t i = 0; i < lights.size(); i++) {
+        const Light& l = lights[i];
+        float xmin = std::numeric_limits<float>::max(), xmax = -std::numeric_limits<float>::max();
+        float ymin = xmin, ymax = xmax, w0 = xmin, w1 = xmax;
+        bool behind = false;
+        for(int k = 0; k < 8; k++) {
+            vec3f corner = l.position + vec3f((k & 1) ? l.radius : -l.radius, (k & 2) ? l.radius : -l.radius, (k & 4) ? l.radius : -l.radius);
+            vec4f p = toScreen * embed<float, 4>(corner);
+            w0 = std::min(w0, p[3]);
+            w1 = std::max(w1, p[3]);
+            if(!(p[3] > near_w)) {
+                behind = true;
+                continue;
+            }
+            xmin = std::min(xmin, p[0] / p[3]);
+            xmax = std::max(xmax, p[0] / p[3]);
+            ymin = std::min(ymin, p[1] / p[3] - ctx.yoffset);
+            ymax = std::max(ymax, p[1] / p[3] - ctx.yoffset);
+        }
+        Range& r = ranges[i];
+        if(behind) { // reaches behind the near plane, the screen box is unbounded
+            r.x0 = r.y0 = 0;
+            r.x1 = width - 1;
+            r.y1 = height - 1;
+        } else {
+            r.x0 = std::max(0, (int)std::floor(xmin) / tile);
+            r.y0 = std::max(0, (int)std::floor(ymin) / tile);
+            r.x1 = std::min(width - 1, (int)std::floor(xmax + 1) / tile);
+            r.y1 = std::min(height - 1, (int)std::floor(ymax + 1) / tile);
+            if(xmax < 0 || ymax < 0) r.x1 = -1; // left of or above the target
+        }
+        r.s0 = slice(w0);
+        r.s1 = slice(w1);
+        if(w1 <= near_w) r.x1 = -1; // entirely behind the eye
+    }
+
+    // counting pass, then fill: lights are visited in order so every cell lists them ascending
+    for(const Range& r: ranges) {
+        for(int s = r.s0; s <= r.s1; s++) {
+            for(int ty = r.y0; ty <= r.y1; ty++) {
+                for(int tx = r.x0; tx <= r.x1; tx++) {
+                    offsets[cell(tx, ty, s) + 1]++;
+                }
+            }
+        }
+    }
+    for(std::size_t c = 1; c < offsets.size(); c++) {
+        offsets[c] += offsets[c - 1];
+    }
+    indices.resize(offsets.back());
+    std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+    for(std::size_t i = 0; i < ranges.size(); i++) {
+        const Range& r = ranges[i];
+        for(int s = r.s0; s <= r.s1; s++) {
+            for(int ty = r.y0; ty <= r.y1; ty++) {
+                for(int tx = r.x0; tx <= r.x1; tx++) {
+                    indices[fill[cell(tx, ty, s)]++] = i;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef __LIGHTS_H__
+#define __LIGHTS_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "geometry.h"
+
+class RenderContext;
+
+enum LightType
+{
+    POINT_LIGHT,
+    SPOT_LIGHT
+};
+
+/**
+ * a local light, it reaches no further than radius: the falloff is (1 - d^2 / radius^2)^2
+*/
+struct Light
+{
+    LightType type = POINT_LIGHT;
+    vec3f position;
+    vec3f color = vec3f(1, 1, 1); // rgb intensity
+    float radius = 1;
+    vec3f direction = vec3f(0, -1, 0); // spot lights only, the cone axis
+    float cosOuter = 0.7f; // spot lights only, cosine of the cone half angle, no light outside
+    float cosInner = 0.9f; // spot lights only, full intensity inside this cosine
+};
+
+/**
+ * The lights of a frame in camera coordinates plus the light grid that culls them: the screen is cut
+ * into tile x tile pixel tiles and the camera depth range into slices, every cell of tiles x slices
+ * keeps the indices of the lights whose bounds reach it, in ascending order.
+ * Without the grid (tiled false) every fragment loops over every light.
+*/
+struct LightSet
+{
+    std::vector<Light> lights; // camera coordinates
+    bool tiled = true;
+    int tile = 32; // side of a screen tile in pixels
+    int slices = 16; // depth slices of the w range
+    float minW = 0, maxW = 1; // clip w range sliced, fragments outside use the first or last slice
+    int width = 0, height = 0; // in tiles
+    std::vector<int> offsets; // start of every cell in indices, one more entry than cells
+    std::vector<std::uint16_t> indices; // so at most 65536 lights
+
+    /**
+     * transform the world space lights into the camera of ctx and build the grid for its whole frame
+     * @param minW, maxW clip w range of the visible scene, sliced for depth culling
+    */
+    void build(const RenderContext& ctx, const std::vector<Light>& worldLights, const float minW, const float maxW);
+
+    int slice(const float w) const {
+        const int s = (int)((w - minW) / (maxW - minW) * slices);
+        return std::max(0, std::min(slices - 1, s));
+    }
+    int cell(const int tx, const int ty, const int s) const { return (s * height + ty) * width + tx; }
+    long listed() const { return indices.size(); } // light references over all cells
+};
+
+#endif
@@ -1,100 +1,735 @@
 #include <iostream>
 #include<vector>
 #include<limits>
+#include<future>
+#include<memory>
+#include<cmath>
+#include<cstring>
+#include<cstdlib>
+#include<chrono>
+#include<map>
+#include<fstream>
+#include<sstream>
+#include<thread>
+#include<random>
+#include<atomic>
 
 #include "tgaimage.h"
 #include "geometry.h"
 #include "model.h"
 #include "ourGL.h"
+#include "postprocess.h"
+#include "regress.h"
+#include "trace.h"
+#include "scene.h"
+#include "incremental.h"
+#include "shader.h"
+#include "server.h"
+#include "synthetic.h"
+#include "bench.h"
+#include "lights.h"
 
-constexpr int width = 1024;
-constexpr int height = 1024;
+constexpr int default_width = 1024;
+constexpr int default_height = 1024;
 
-extern mat4f ModelView;
-extern mat4f Viewport;
-extern mat4f Projection;
 
+// the fixed scenes that can be picked with --scene, each is drawn on top of the floor
+const std::map<std::string, std::vector<std::string>> scenes = {
+    {"diablo", {"../obj/diablo3_pose/diablo3_pose.obj", "../obj/floor.obj"}},
+    {"head", {"../obj/african_head/african_head.obj", "../obj/african_head/african_head_eye_inner.obj",
+        "../obj/african_head/african_head_eye_outer.obj", "../obj/floor.obj"}},
+    {"boggie", {"../obj/boggie/body.obj", "../obj/boggie/head.obj", "../obj/boggie/eyes.obj", "../obj/floor.obj"}},
+};
 
-const vec3f lightDir(1.0f, 1.0f, 1.0f);
-const vec3f eye(1.0f, 1.0f, 3.0f);
+const vec3f default_eye(1.0f, 1.0f, 3.0f);
 const vec3f center(0.0f, 0.0f, 0.0f);
 const vec3f up(0.0f, 1.0f, 0.0f);
 
-class IShader: public Shader {
-    const Model& model;
-    vec3f light; // light directory normalized in camera coordinates
-    mat<float, 2, 3> varying_uv; //  triangle uv coordinates, written by vertex shader, read by fragment shader
-    mat3f varying_nrm; // normal of per vertex of triangle
-    mat3f ndc_tri; // vertex with homogenous coordinates in triangle
-
-public:    
-    IShader(const Model& m): model(m){
-        light = (proj<float, 3>(Projection * ModelView * embed<float, 4>(lightDir, 0.0f))).normalize(); // tramsform lightDir into camera coordinates
-    }
-
-    
-    virtual vec4f vertex(const int iface, const int nthvert) override {
-        varying_uv.set_col(nthvert, model.uv(iface, nthvert));
-        varying_nrm.set_col(nthvert, proj<float, 3>((Projection * ModelView).invert_transpose() * embed<float, 4>(model.normal(iface, nthvert), 0.0f))); // transform normal, reference: https://github.com/ssloy/tinyrenderer/wiki/Lesson-5-Moving-the-camera
-        vec4f glVertex = Projection * ModelView * embed<float, 4>(model.vert(iface, nthvert));
-        ndc_tri.set_col(nthvert, proj<float, 3>(glVertex/glVertex[3]));
-        return glVertex;
-    }
-
-    virtual bool fragment(const vec3f& bar, TGAColor& color) override {
-        vec3f bn = (varying_nrm * bar).normalize();
-        vec2f uv = varying_uv * bar;
-        // use tangent space normal texture, you can read by: https://github.com/ssloy/tinyrenderer/wiki/Lesson-6bis-tangent-space-normal-mapping
-        mat3f AI = mat3f{
-            {
-                ndc_tri.col(1) - ndc_tri.col(0),
-                ndc_tri.col(2) - ndc_tri.col(0),
-                bn
+/**
+ * models loading in the background, models[i] becomes ready once paths[i] is parsed
+*/
+struct ModelLoads
+{
+    std::vector<std::future<std::unique_ptr<Model>>> models;
+    std::vector<std::future<void>> loaders; // waited for when destroyed, before models
+};
+
+/**
+ * start loading the models on at most one thread per hardware thread, the loaders take the paths
+ * in list order, so the futures become ready roughly one by one while the caller is already rendering
+*/
+ModelLoads load_models_async(const std::vector<std::string>& paths) {
+    ModelLoads loads;
+    auto promises = std::make_shared<std::vector<std::promise<std::unique_ptr<Model>>>>(paths.size());
+    for(auto& promise: *promises) {
+        loads.models.push_back(promise.get_future());
+    }
+    auto next = std::make_shared<std::atomic<std::size_t>>(0);
+    const std::size_t nthreads = std::min<std::size_t>(paths.size(), std::max(1u, std::thread::hardware_concurrency()));
+    for(std::size_t t = 0; t < nthreads; t++) {
+        loads.loaders.push_back(std::async(std::launch::async, [paths, promises, next]() {
+            for(std::size_t i; (i = (*next)++) < paths.size(); ) {
+                try {
+                    (*promises)[i].set_value(std::unique_ptr<Model>(new Model(paths[i])));
+                } catch(...) {
+                    (*promises)[i].set_exception(std::current_exception());
+                }
+            }
+        }));
+    }
+    return loads;
+}
+
+/**
+ * fill world with grid x grid copies of every model but the last one (the floor), scaled to
+ * fit one cell of the floor each and standing on it, plus the floor itself
+ * @param wall also stand a copy of the floor upright across the middle, hiding the back half of the grid
+*/
+void build_grid(Scene& world, const std::vector<std::unique_ptr<Model>>& models, const int grid, const bool wall) {
+    const float s = 2.0f / grid;
+    for(int i = 0; i < grid; i++) {
+        for(int j = 0; j < grid; j++) {
+            mat4f transform = {{{s, 0, 0, -1 + (i + 0.5f) * s}, {0, s, 0, s - 1}, {0, 0, s, -1 + (j + 0.5f) * s}, {0, 0, 0, 1}}};
+            for(std::size_t k = 0; k + 1 < models.size(); k++) {
+                world.add(*models[k], transform);
             }
-        }.invert();
-        vec3f i = AI * vec3f(varying_uv[0][1] - varying_uv[0][0], varying_uv[0][2] - varying_uv[0][0], 0.0f);
-        vec3f j = AI * vec3f(varying_uv[1][1] - varying_uv[1][0], varying_uv[1][2] - varying_uv[1][0], 0.0f);
-        
-        mat3f B = mat3f{ {i.normalize(), j.normalize(), bn} }.transpose();
-        vec3f n = (B * model.normal(uv)).normalize(); // get normal from tangent space
-        vec3f r = (n * (n * light) * 2 - light).normalize(); // Phone shading， https://github.com/ssloy/tinyrenderer/wiki/Lesson-6-Shaders-for-the-software-renderer
-        float specular = std::pow(std::max(r.z, 0.0f), 5 + model.specular(uv));
-        float diffuse = std::max(0.0f, n * light);
-        float ambient = 10;
-        TGAColor c = model.diffuse(uv);
-        color = c;
-        for(int i = 0; i < 3; i++) {
-            color[i] = std::min<int>((ambient + c[i] * (diffuse + specular)), 255);
         }
-        return false;
     }
-};
+    world.add(*models.back(), mat4f::identity());
+    if(wall) {
+        world.add(*models.back(), {{{1, 0, 0, 0}, {0, 0, -1, 0}, {0, 1, 0, 1}, {0, 0, 0, 1}}});
+    }
+    world.build();
+}
+
+/**
+ * render the frame one horizontal band of at most bandHeight rows at a time and stream every
+ * finished band into the output file, so only one band of color and depth is resident.
+ * Faces are binned per band up front; each band redraws its faces in the original order,
+ * so the result is identical to a full-frame render.
+*/
+bool render_banded(RenderContext& ctx, const std::vector<std::unique_ptr<Model>>& models, const int width, const int height,
+    const int bandHeight, const std::string& output, const bool rle, const PostSettings& post) {
+    const int nbands = (height + bandHeight - 1) / bandHeight;
+    std::vector<std::vector<std::vector<int>>> bins(models.size(), std::vector<std::vector<int>>(nbands));
+    TraceZone binZone("bin faces");
+    for(std::size_t k = 0; k < models.size(); k++) {
+        IShader shader(ctx, *models[k]);
+        for(int i = 0; i < models[k]->nfaces(); i++) {
+            vec4f pts[3];
+            for(int j = 0; j < 3; j++) {
+                pts[j] = ctx.Viewport * shader.vertex(i, j);
+            }
+            // y extent of the part in front of the near plane, the part triangle() rasterizes;
+            // the projection of a vertex behind it says nothing about the rows covered
+            float ymin = std::numeric_limits<float>::max();
+            float ymax = -std::numeric_limits<float>::max();
+            for(int j = 0; j < 3; j++) {
+                const vec4f& a = pts[j];
+                const vec4f& b = pts[(j + 1) % 3];
+                const float da = a[3] - near_w, db = b[3] - near_w;
+                if(da >= 0) {
+                    ymin = std::min(ymin, a[1] / a[3]);
+                    ymax = std::max(ymax, a[1] / a[3]);
+                }
+                if((da >= 0) != (db >= 0)) {
+                    const vec4f c = a + (b - a) * (da / (da - db));
+                    ymin = std::min(ymin, c[1] / c[3]);
+                    ymax = std::max(ymax, c[1] / c[3]);
+                }
+            }
+            if(!(ymin <= ymax)) continue; // degenerated projection, triangle() draws nothing either
+            int first = (int)std::floor(std::max(ymin, 0.0f));
+            int last = (int)std::min(ymax, height - 1.0f);
+            if(first > last) continue;
+            for(int b = first / bandHeight; b <= last / bandHeight; b++) {
+                bins[k][b].push_back(i);
+            }
+        }
+    }
+
+    binZone.end();
+
+    TGAStreamWriter writer(output, width, height, TGAImage::RGB, true, rle);
+    for(int b = 0; b < nbands && writer.good(); b++) {
+        TRACE_SCOPE("band");
+        const int y0 = b * bandHeight;
+        const int rows = std::min(bandHeight, height - y0);
+        ctx.set_target(width, rows, y0, height);
+        for(std::size_t k = 0; k < models.size(); k++) {
+            IShader shader(ctx, *models[k]);
+            for(int i: bins[k][b]) {
+                std::array<vec4f, 3> clipVerts = {};
+                for(int j = 0; j < 3; j++) {
+                    clipVerts[j] = shader.vertex(i, j);
+                }
+                triangle(ctx, clipVerts, shader);
+            }
+        }
+        post_process(ctx, post);
+        TRACE_SCOPE("write rows");
+        writer.write_rows(ctx.image.buffer(), rows);
+    }
+    return writer.finish();
+}
 
-int main(int, char**) {
+/**
+ * draw the models, then move the first one a little every frame for frames frames and redraw
+ * only the tiles it left or entered. The last frame is checked against a full redraw.
+ * @return false when the incremental and the full frame differ
+*/
+bool render_edits(RenderContext& ctx, const std::vector<std::unique_ptr<Model>>& models, const int frames) {
+    IncrementalRenderer renderer(ctx, [](RenderContext& c, const Draw& d) { render_model(c, *d.model, d.transform, d.light); });
+    for(const auto& m: models) {
+        renderer.add({m.get(), mat4f::identity(), lightDir});
+    }
+    ctx.clear();
+    renderer.render();
 
-    std::vector<std::string> modelPaths = {
-        "../obj/diablo3_pose/diablo3_pose.obj",
-        "../obj/floor.obj"
+    double totalMs = 0, maxMs = 0, totalFraction = 0;
+    for(int f = 1; f <= frames; f++) {
+        Draw d = renderer.get(0);
+        d.transform[0][3] = 0.02f * f;
+        renderer.update(0, d);
+        auto editStart = std::chrono::steady_clock::now();
+        IncrementalStats stats = renderer.render();
+        double editMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - editStart).count();
+        totalMs += editMs;
+        maxMs = std::max(maxMs, editMs);
+        totalFraction += stats.redrawnFraction();
+    }
 
-    };
-    std::vector<float> zBuffer(width * height, -std::numeric_limits<float>::max());
-    TGAImage image(width, height, TGAImage::RGB);
-    lookat(eye, center, up);
-    viewport(width / 8, height / 8, width * 3 / 4, height * 3 / 4);
-    projection(-1.0f/(eye - center).norm());
+    RenderContext full(ctx.image.get_width(), ctx.image.get_height());
+    full.ModelView = ctx.ModelView;
+    full.Viewport = ctx.Viewport;
+    full.Projection = ctx.Projection;
+    full.useHiZ = ctx.useHiZ;
+    auto fullStart = std::chrono::steady_clock::now();
+    for(std::size_t i = 0; i < models.size(); i++) {
+        const Draw& d = renderer.get(i);
+        render_model(full, *d.model, d.transform, d.light);
+    }
+    double fullMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - fullStart).count();
+
+    std::cerr << "incremental edits " << frames << ": re-rendered " << 100.0 * totalFraction / frames << "% of the tiles, latency mean "
+        << totalMs / frames << " ms, max " << maxMs << " ms, full redraw " << fullMs << " ms" << std::endl;
+    TGAImage diff;
+    ImageDiff d = compare_images(ctx.image, full.image, 0, diff);
+    if(d.mismatched) {
+        std::cerr << "incremental frame differs from a full redraw in " << d.mismatched << " pixels" << std::endl;
+    }
+    return d.mismatched == 0;
+}
 
-    for(const auto& path: modelPaths) {
-        Model m(path);
-        IShader shader(m);
-        for(int i = 0; i < m.nfaces(); i++) {
-            std::array<vec4f, 3> clipVerts = {};
+/**
+ * compare the written output with the golden image, on mismatch a diff image is written next to the output
+ * @return true when every pixel is within tolerance, or the golden image was (re)written with update
+*/
+bool check_golden(const std::string& output, const std::string& golden, const int tolerance, const bool update) {
+    if(update) {
+        // copy the file as is, a read/write round trip through TGAImage would flip it
+        std::cerr << "updating golden image " << golden << std::endl;
+        std::ifstream in(output, std::ios::binary);
+        std::ofstream out(golden, std::ios::binary);
+        out << in.rdbuf();
+        return in.good() && out.good();
+    }
+    TGAImage result;
+    if(!result.read_tga_file(output)) return false;
+    TGAImage reference;
+    if(!reference.read_tga_file(golden)) {
+        std::cerr << "no golden image " << golden << ", run with --update-golden to create it" << std::endl;
+        return false;
+    }
+    if(reference.get_bytespp() != result.get_bytespp()) {
+        // e.g. resaved as rgba by an image editor, compare the colors
+        std::cerr << "converting golden image " << golden << " from " << reference.get_bytespp() << " to "
+            << result.get_bytespp() << " bytes per pixel" << std::endl;
+        reference.convert(result.get_bytespp());
+    }
+    TGAImage diff;
+    ImageDiff d = compare_images(result, reference, tolerance, diff);
+    if(!d.sizeMatch) {
+        std::cerr << "golden image " << golden << " has a different size or format" << std::endl;
+        return false;
+    }
+    std::cerr << "golden " << golden << ": " << d.mismatched << " pixels over tolerance " << tolerance
+        << ", max error " << d.maxError << std::endl;
+    if(d.mismatched) {
+        diff.write_tga_file(output + ".diff.tga");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * n point and spot lights of random color scattered over the scene cube [-1, 1]^3, the
+ * intensity shrinks with n so the overlap of many lights doesn't saturate
+*/
+std::vector<Light> random_lights(const int n) {
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<Light> lights(n);
+    const float intensity = 2.0f / std::sqrt((float)n);
+    for(int i = 0; i < n; i++) {
+        Light& l = lights[i];
+        l.type = i % 2 ? SPOT_LIGHT : POINT_LIGHT;
+        l.position = vec3f(unit(rng) * 2 - 1, unit(rng) * 1.9f - 0.9f, unit(rng) * 2 - 1);
+        l.color = vec3f(unit(rng), unit(rng), unit(rng)) * intensity;
+        l.radius = 0.2f + unit(rng) * 0.2f;
+        l.direction = vec3f(unit(rng) - 0.5f, -1, unit(rng) - 0.5f).normalize();
+    }
+    return lights;
+}
+
+/**
+ * parse a comma separated list of positive integers such as "1,2,4", empty when malformed
+*/
+std::vector<int> parse_list(const std::string& text) {
+    std::vector<int> values;
+    std::istringstream iss(text);
+    std::string item;
+    while(std::getline(iss, item, ',')) {
+        int v = std::atoi(item.c_str());
+        if(v <= 0) return {};
+        values.push_back(v);
+    }
+    return values;
+}
+
+/**
+ * usage: CMakeLists [--scene diablo|head|boggie] [--size width height] [--band rows] [--raw] [--mmap] [-o output.tga]
+ *                   [--ssao] [--exposure e] [--gamma g]
+ *                   [--golden ref.tga [--tolerance n] [--update-golden]] [--baseline file [--max-slowdown r] [--update-baseline]]
+ *                   [--trace trace.json [--trace-fragments]] [--no-hiz] [--repeat n] [--grid n [--wall]] [--edit-frames n]
+ *                   [--shading-rate 2|4] [--adaptive-rate] [--eye x y z] [--lights n [--brute-lights]] [--supersample n]
+ *        CMakeLists --serve socket [--workers n]
+ *        CMakeLists [--scene s] [--size width height] [-o output.tga] --client socket [request...]
+ *        CMakeLists --generate model.obj [--faces n] [--tri-size small|mixed|large] [--layers n] [--seed n]
+ *        CMakeLists --bench model.obj [--instances n] [--sizes 512,1024] [--threads 1,2,4] [--repeat n] [--no-hiz]
+ *        CMakeLists --bench-math
+ * --band renders out-of-core in bands of the given height, --raw writes an uncompressed tga,
+ * --mmap renders straight into the memory mapped (uncompressed) output file,
+ * --ssao/--exposure/--gamma enable ambient occlusion, tone mapping and gamma correction,
+ * --golden compares the output with a reference image and --baseline checks the render time, the best of
+ * warm redraws with the models loaded (at least 2 of them), --update-baseline records it instead;
+ * the exit code is non zero when either check fails, --trace writes a chrome trace-event timeline,
+ * --no-hiz disables the hierarchical z rejection, --repeat redraws the frame n - 1 more times with the
+ * models already loaded and reports the best render time (full frame mode only),
+ * --grid places n x n scaled copies of the scene models on the floor and draws them through the
+ * scene hierarchy with occlusion culling, --wall adds an occluder across the middle of the grid,
+ * --edit-frames moves the first model over n frames redrawing only the dirty tiles and reports the latency,
+ * --shading-rate shades the floor once per 2x2 or 4x4 pixels, --adaptive-rate picks the rate of every
+ * 8x8 block from the contrast of a first, fully shaded frame; both redraw the frame coarsely after the
+ * full one and report the saved fragment shader calls and the error against it (full frame mode only),
+ * --eye moves the camera, e.g. into the scene to check near plane clipping,
+ * --lights adds n random point and spot lights culled per screen tile and depth slice,
+ * --brute-lights shades every fragment with every light instead, for comparison (full frame mode only),
+ * --supersample renders n times wider and higher and box filters the frame down to the output size
+ * (full frame mode only),
+ * --serve renders requests from a unix domain socket with warm assets on n workers (see serve()),
+ * --client sends the rest of the command line as a request to that socket and prints the reply,
+ * without a request it asks to render the scene into the output path,
+ * --generate writes a synthetic triangle soup with its textures (see write_synthetic_model),
+ * --bench measures throughput and parallel efficiency over frame sizes and thread counts (see run_benchmark),
+ * --bench-math times the float matrix fast paths against the generic code (see run_math_benchmark)
+*/
+int main(int argc, char** argv) {
+    int width = default_width;
+    int height = default_height;
+    int bandHeight = 0;
+    bool rle = true;
+    bool mapOutput = false;
+    std::string output = "result.tga";
+    PostSettings post;
+    std::string scene = "diablo";
+    std::string golden;
+    int tolerance = 0;
+    bool updateGolden = false;
+    std::string baseline;
+    double maxSlowdown = 1.25;
+    bool updateBaseline = false;
+    std::string tracePath;
+    bool traceFragments = false;
+    bool useHiZ = true;
+    int repeat = 1;
+    int grid = 0;
+    bool wall = false;
+    int editFrames = 0;
+    int floorRate = 1;
+    bool adaptiveRate = false;
+    std::string servePath;
+    int workers = std::max(1u, std::thread::hardware_concurrency());
+    std::string clientPath;
+    std::string request;
+    vec3f eye = default_eye;
+    int nlights = 0;
+    bool bruteLights = false;
+    int supersample = 1;
+    std::string generatePath;
+    SyntheticSpec synthetic;
+    BenchConfig bench;
+    bool benchMath = false;
+    for(int i = 1; i < argc; i++) {
+        if(!std::strcmp(argv[i], "--scene") && i + 1 < argc) {
+            scene = argv[++i];
+        } else if(!std::strcmp(argv[i], "--golden") && i + 1 < argc) {
+            golden = argv[++i];
+        } else if(!std::strcmp(argv[i], "--tolerance") && i + 1 < argc) {
+            tolerance = std::atoi(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--update-golden")) {
+            updateGolden = true;
+        } else if(!std::strcmp(argv[i], "--baseline") && i + 1 < argc) {
+            baseline = argv[++i];
+        } else if(!std::strcmp(argv[i], "--max-slowdown") && i + 1 < argc) {
+            maxSlowdown = std::atof(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--update-baseline")) {
+            updateBaseline = true;
+        } else if(!std::strcmp(argv[i], "--trace") && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if(!std::strcmp(argv[i], "--trace-fragments")) {
+            traceFragments = true;
+        } else if(!std::strcmp(argv[i], "--repeat") && i + 1 < argc) {
+            repeat = std::atoi(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--grid") && i + 1 < argc) {
+            grid = std::atoi(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--edit-frames") && i + 1 < argc) {
+            editFrames = std::atoi(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--shading-rate") && i + 1 < argc) {
+            floorRate = std::atoi(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--adaptive-rate")) {
+            adaptiveRate = true;
+        } else if(!std::strcmp(argv[i], "--serve") && i + 1 < argc) {
+            servePath = argv[++i];
+        } else if(!std::strcmp(argv[i], "--workers") && i + 1 < argc) {
+            workers = std::atoi(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--client") && i + 1 < argc) {
+            clientPath = argv[++i];
+            while(++i < argc) {
+                request += (request.empty() ? "" : " ") + std::string(argv[i]);
+            }
+        } else if(!std::strcmp(argv[i], "--generate") && i + 1 < argc) {
+            generatePath = argv[++i];
+        } else if(!std::strcmp(argv[i], "--faces") && i + 1 < argc) {
+            synthetic.faces = std::atol(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--tri-size") && i + 1 < argc) {
+            std::string sizes = argv[++i];
+            synthetic.sizes = sizes == "small" ? SMALL_TRIANGLES : sizes == "large" ? LARGE_TRIANGLES : MIXED_TRIANGLES;
+        } else if(!std::strcmp(argv[i], "--layers") && i + 1 < argc) {
+            synthetic.layers = std::atoi(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--seed") && i + 1 < argc) {
+            synthetic.seed = std::atoi(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--bench") && i + 1 < argc) {
+            bench.model = argv[++i];
+        } else if(!std::strcmp(argv[i], "--bench-math")) {
+            benchMath = true;
+        } else if(!std::strcmp(argv[i], "--instances") && i + 1 < argc) {
+            bench.instances = std::atoi(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--sizes") && i + 1 < argc) {
+            bench.sizes = parse_list(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--threads") && i + 1 < argc) {
+            bench.threads = parse_list(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--eye") && i + 3 < argc) {
             for(int j = 0; j < 3; j++) {
-                clipVerts[j] = shader.vertex(i, j);
+                eye[j] = std::atof(argv[++i]);
             }
-            triangle(clipVerts, shader, image, zBuffer);
+        } else if(!std::strcmp(argv[i], "--lights") && i + 1 < argc) {
+            nlights = std::atoi(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--brute-lights")) {
+            bruteLights = true;
+        } else if(!std::strcmp(argv[i], "--supersample") && i + 1 < argc) {
+            supersample = std::atoi(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--wall")) {
+            wall = true;
+        } else if(!std::strcmp(argv[i], "--no-hiz")) {
+            useHiZ = false;
+        } else if(!std::strcmp(argv[i], "--size") && i + 2 < argc) {
+            width = std::atoi(argv[++i]);
+            height = std::atoi(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--band") && i + 1 < argc) {
+            bandHeight = std::atoi(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--raw")) {
+            rle = false;
+        } else if(!std::strcmp(argv[i], "--mmap")) {
+            mapOutput = true;
+        } else if(!std::strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = argv[++i];
+        } else if(!std::strcmp(argv[i], "--ssao")) {
+            post.ssao = true;
+        } else if(!std::strcmp(argv[i], "--exposure") && i + 1 < argc) {
+            post.tonemap = true;
+            post.exposure = std::atof(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--gamma") && i + 1 < argc) {
+            post.gamma = std::atof(argv[++i]);
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--scene diablo|head|boggie] [--size width height] [--band rows] [--raw] [--mmap]"
+                " [-o output.tga] [--ssao] [--exposure e] [--gamma g]"
+                " [--golden ref.tga [--tolerance n] [--update-golden]] [--baseline file [--max-slowdown r] [--update-baseline]]"
+                " [--trace trace.json [--trace-fragments]] [--no-hiz] [--repeat n] [--grid n [--wall]] [--edit-frames n]"
+                " [--shading-rate 2|4] [--adaptive-rate] [--eye x y z] [--lights n [--brute-lights]] [--supersample n]\n"
+                "       " << argv[0] << " --serve socket [--workers n]\n"
+                "       " << argv[0] << " [--scene s] [--size width height] [-o output.tga] --client socket [request...]\n"
+                "       " << argv[0] << " --generate model.obj [--faces n] [--tri-size small|mixed|large] [--layers n] [--seed n]\n"
+                "       " << argv[0] << " --bench model.obj [--instances n] [--sizes 512,1024] [--threads 1,2,4] [--repeat n] [--no-hiz]\n"
+                "       " << argv[0] << " --bench-math" << std::endl;
+            return 1;
+        }
+    }
+    if(width <= 0 || height <= 0 || width > 65535 || height > 65535 || bandHeight < 0) {
+        std::cerr << "bad image size or band height" << std::endl;
+        return 1;
+    }
+    if(post.gamma <= 0 || post.exposure <= 0) {
+        std::cerr << "gamma and exposure must be positive" << std::endl;
+        return 1;
+    }
+    if(mapOutput && bandHeight > 0) {
+        std::cerr << "--mmap renders the full frame into the file, it can't be combined with --band" << std::endl;
+        return 1;
+    }
+    if(grid > 0 && bandHeight > 0) {
+        std::cerr << "--grid can't be combined with --band" << std::endl;
+        return 1;
+    }
+    if(editFrames > 0 && (bandHeight > 0 || grid > 0 || repeat > 1 || post.enabled())) {
+        std::cerr << "--edit-frames redraws parts of the previous frame, it can't be combined with --band, --grid, --repeat or post processing" << std::endl;
+        return 1;
+    }
+    if(editFrames > 0 && !baseline.empty()) {
+        std::cerr << "--edit-frames reports its own latency, it can't be combined with --baseline" << std::endl;
+        return 1;
+    }
+    if(!baseline.empty() && bandHeight == 0) {
+        repeat = std::max(repeat, 3); // the first frame also waits for the models to load, time warm redraws only
+    }
+    if(nlights < 0 || nlights > 65536 || (nlights > 0 && bandHeight > 0)) {
+        std::cerr << "--lights takes 0 to 65536 lights and can't be combined with --band" << std::endl;
+        return 1;
+    }
+    if(floorRate != 1 && floorRate != 2 && floorRate != 4) {
+        std::cerr << "the shading rate is 1, 2 or 4" << std::endl;
+        return 1;
+    }
+    if((floorRate > 1 || adaptiveRate) && (bandHeight > 0 || editFrames > 0)) {
+        std::cerr << "coarse shading compares full frames, it can't be combined with --band or --edit-frames" << std::endl;
+        return 1;
+    }
+    if(supersample < 1 || supersample > 4 || (long)width * supersample > 65535 || (long)height * supersample > 65535) {
+        std::cerr << "--supersample takes 1 to 4 and the supersampled frame must fit the image size limit" << std::endl;
+        return 1;
+    }
+    if(supersample > 1 && (bandHeight > 0 || mapOutput || editFrames > 0)) {
+        std::cerr << "--supersample filters the full frame, it can't be combined with --band, --mmap or --edit-frames" << std::endl;
+        return 1;
+    }
+    if(!scenes.count(scene)) {
+        std::cerr << "unknown scene " << scene << std::endl;
+        return 1;
+    }
+    if(!generatePath.empty()) {
+        if(synthetic.faces <= 0 || synthetic.layers <= 0) {
+            std::cerr << "faces and layers must be positive" << std::endl;
+            return 1;
+        }
+        return write_synthetic_model(generatePath, synthetic) ? 0 : 1;
+    }
+    if(benchMath) {
+        run_math_benchmark();
+        return 0;
+    }
+    if(!bench.model.empty()) {
+        if(bench.sizes.empty() || bench.threads.empty() || bench.instances <= 0) {
+            std::cerr << "bad --sizes, --threads or --instances" << std::endl;
+            return 1;
+        }
+        if(repeat > 1) bench.repeat = repeat;
+        bench.useHiZ = useHiZ;
+        bench.eye = eye;
+        bench.center = center;
+        bench.up = up;
+        return run_benchmark(bench) ? 0 : 1;
+    }
+    if((eye - center).norm() == 0) {
+        std::cerr << "the eye can't be at the center" << std::endl;
+        return 1;
+    }
+    if(!servePath.empty()) {
+        return serve(servePath, workers) ? 0 : 1;
+    }
+    if(!clientPath.empty()) {
+        if(request.empty()) {
+            std::ostringstream oss;
+            oss << "render " << width << " " << height;
+            for(const vec3f& v: {eye, center, up}) {
+                oss << " " << v.x << " " << v.y << " " << v.z;
+            }
+            oss << " " << output;
+            for(const auto& path: scenes.at(scene)) {
+                oss << " " << path;
+            }
+            request = oss.str();
+        }
+        std::string reply = send_request(clientPath, request);
+        if(reply.empty()) {
+            std::cerr << "no reply from " << clientPath << std::endl;
+            return 1;
+        }
+        std::cout << reply << std::endl;
+        return reply.compare(0, 2, "ok") ? 1 : 0;
+    }
+    if(post.ssao && bandHeight > 0) {
+        std::cerr << "ssao needs the depth of neighbouring bands, it is disabled in band mode" << std::endl;
+        post.ssao = false;
+    }
+
+    if(!tracePath.empty()) {
+        trace_enable(traceFragments ? TRACE_FRAGMENTS : TRACE_STAGES);
+    }
+    auto start = std::chrono::steady_clock::now();
+    ModelLoads loads = load_models_async(scenes.at(scene));
+    auto& models = loads.models;
+    const int renderWidth = width * supersample, renderHeight = height * supersample;
+    RenderContext ctx(renderWidth, bandHeight > 0 || mapOutput ? 0 : renderHeight);
+    if(mapOutput && !ctx.map_target(output, width, height)) {
+        return 1;
+    }
+    ctx.lookat(eye, center, up);
+    ctx.viewport(renderWidth / 8, renderHeight / 8, renderWidth * 3 / 4, renderHeight * 3 / 4);
+    ctx.projection(-1.0f/(eye - center).norm());
+    ctx.useHiZ = useHiZ;
+    LightSet lights;
+    if(nlights > 0) {
+        // slice the w range the scene cube covers
+        float minW = std::numeric_limits<float>::max(), maxW = -std::numeric_limits<float>::max();
+        for(int k = 0; k < 8; k++) {
+            vec4f p = ctx.Projection * ctx.ModelView * embed<float, 4>(vec3f((k & 1) ? 1 : -1, (k & 2) ? 1 : -1, (k & 4) ? 1 : -1));
+            minW = std::min(minW, p[3]);
+            maxW = std::max(maxW, p[3]);
+        }
+        lights.tiled = !bruteLights;
+        auto buildStart = std::chrono::steady_clock::now();
+        lights.build(ctx, random_lights(nlights), std::max(minW, near_w), maxW);
+        double buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count();
+        ctx.lights = &lights;
+        if(lights.tiled) {
+            std::cerr << "light grid " << lights.width << "x" << lights.height << "x" << lights.slices << ", " << nlights << " lights, "
+                << (double)lights.listed() / (lights.offsets.size() - 1) << " per cell, built in " << buildMs << " ms" << std::endl;
         }
     }
-    
-    image.write_tga_file("result.tga");
-}
 
+    bool ok = true;
+    double bestRenderMs = 0;
+    CullStats cull;
+    if(bandHeight > 0) {
+        // every band needs every model, so wait for all of them
+        std::vector<std::unique_ptr<Model>> loaded;
+        for(auto& model: models) {
+            loaded.push_back(model.get());
+        }
+        auto renderStart = std::chrono::steady_clock::now();
+        ok = render_banded(ctx, loaded, width, height, bandHeight, output, rle, post);
+        bestRenderMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - renderStart).count();
+    } else {
+        std::vector<std::unique_ptr<Model>> loaded;
+        Scene world;
+        ShadingRateMap rateMap;
+        int floorShadingRate = 1; // the first frame is always shaded per pixel
+        // the floor, the last model of every scene, is smooth enough to be shaded coarsely
+        auto draw_model = [&](const Model& m, const mat4f& transform) {
+            ctx.shadingRate = &m == loaded.back().get() ? floorShadingRate : 1;
+            render_model(ctx, m, transform);
+        };
+        auto draw_frame = [&]() {
+            if(grid > 0) {
+                cull = world.draw(ctx, eye, [&](const Instance& inst) { draw_model(*inst.model, inst.transform); });
+            } else {
+                for(const auto& m: loaded) {
+                    draw_model(*m, mat4f::identity());
+                }
+            }
+            post_process(ctx, post);
+        };
+        if(grid > 0) {
+            for(auto& model: models) {
+                loaded.push_back(model.get());
+            }
+            build_grid(world, loaded, grid, wall);
+            draw_frame();
+        } else if(editFrames > 0) {
+            for(auto& model: models) {
+                loaded.push_back(model.get());
+            }
+            ok = render_edits(ctx, loaded, editFrames);
+        } else {
+            // draw in list order so the result does not depend on which load finishes first,
+            // later models keep loading while the earlier ones are rasterized
+            for(auto& model: models) {
+                loaded.push_back(model.get());
+                render_model(ctx, *loaded.back());
+            }
+            post_process(ctx, post);
+        }
+        if(floorRate > 1 || adaptiveRate) {
+            // the frame just drawn shades every pixel, it is the reference of the coarse one
+            TGAImage reference = ctx.image;
+            const long fullInvocations = ctx.stats.invocations;
+            if(adaptiveRate) {
+                rateMap.build(reference);
+                ctx.rateMap = &rateMap;
+            }
+            floorShadingRate = floorRate;
+            ctx.clear();
+            ctx.stats = RasterStats();
+            draw_frame();
+            TGAImage diff;
+            ImageDiff d = compare_images(ctx.image, reference, 0, diff);
+            std::cerr << "coarse shading: " << ctx.stats.invocations << " fragment shader calls for " << ctx.stats.samples
+                << " pixels, " << fullInvocations << " when shading per pixel (" << 100.0 * (fullInvocations - ctx.stats.invocations) / std::max(1L, fullInvocations)
+                << "% fewer), psnr " << d.psnr << " dB, " << d.mismatched << " pixels differ, max error " << d.maxError << std::endl;
+        }
+        // redraw the frame with warm assets to time the rendering alone, stats cover the last run
+        for(int r = 1; r < repeat; r++) {
+            auto renderStart = std::chrono::steady_clock::now();
+            ctx.clear();
+            ctx.stats = RasterStats();
+            draw_frame();
+            double renderMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - renderStart).count();
+            bestRenderMs = r == 1 ? renderMs : std::min(bestRenderMs, renderMs);
+        }
+        if(supersample > 1) {
+            ctx.image.scale(width, height);
+        }
+        ok = (mapOutput ? ctx.image.unmap_tga_file() : ctx.image.write_tga_file(output, true, rle)) && ok;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "frame time " << ms << " ms" << std::endl;
+    if(repeat > 1) {
+        std::cerr << "best render time over " << repeat - 1 << " warm runs " << bestRenderMs << " ms" << std::endl;
+    } else if(bandHeight > 0) {
+        std::cerr << "band render time with the models loaded " << bestRenderMs << " ms" << std::endl;
+    }
+    if(grid > 0) {
+        std::cerr << "instances drawn " << cull.instancesDrawn << ", culled " << cull.instancesCulled
+            << ", bvh nodes visited " << cull.nodesVisited << ", occluded " << cull.nodesOccluded
+            << ", outside " << cull.nodesOutside << std::endl;
+    }
+    const RasterStats& stats = ctx.stats;
+    std::cerr << "triangles " << stats.triangles << ", hiz rejected " << stats.trianglesCulled
+        << " (" << 100.0 * stats.trianglesCulled / std::max(1L, stats.triangles) << "%), blocks " << stats.blocks
+        << ", hiz skipped " << stats.blocksCulled << " (" << 100.0 * stats.blocksCulled / std::max(1L, stats.blocks) << "%)" << std::endl;
+    std::cerr << "degenerate triangles " << stats.degenerate << ", tiny triangles " << stats.tiny
+        << ", outside the frustum " << stats.outside << ", clipped " << stats.clipped << std::endl;
+
+    if(!tracePath.empty()) {
+        trace_dump(tracePath);
+    }
+    if(ok && !golden.empty()) {
+        ok = check_golden(output, golden, tolerance, updateGolden);
+    }
+    if(ok && !baseline.empty()) {
+        std::string key = scene + "_" + std::to_string(width) + "x" + std::to_string(height) + (bandHeight > 0 ? "_band" : "")
+            + (supersample > 1 ? "_ss" + std::to_string(supersample) : "");
+        ok = check_baseline(baseline, key, bestRenderMs, maxSlowdown, updateBaseline);
+    }
+    return ok ? 0 : 1;
+}
@@ -1,4 +1,5 @@
 #include "model.h"
+#include "trace.h"
 
 #include<iostream>
 #include<fstream>
@@ -8,6 +9,8 @@ Model::Model(const std::string filename)
     :verts_(), uv_(), norms_(), facet_vrt_(), facet_nrm_(), facet_tex_(), 
     diffusemap_(), normalmap_(), specularmap_() 
 {   
+    {
+    TRACE_SCOPE("parse obj");
     std::ifstream in;
     in.open(filename, std::ifstream::in);
     if(in.fail()) return;
@@ -51,10 +54,33 @@ Model::Model(const std::string filename)
     }
 
     in.close();
+    }
     std::cerr << "# v# " << nverts() << " f# "  << nfaces() << " vt# " << uv_.size() << " vn# " << norms_.size() << std::endl;
     load_texture(filename, "_diffuse.tga", diffusemap_);
-    load_texture(filename, "_nm_tangent.tga", normalmap_);
-    load_texture(filename, "_spec.tga", specularmap_);
+    TGAImage image;
+    load_texture(filename, "_nm_tangent.tga", image);
+    normalWidth_ = image.get_width();
+    normalHeight_ = image.get_height();
+    normalmap_.resize(normalWidth_ * normalHeight_);
+    for(int y = 0; y < normalHeight_; y++) {
+        for(int x = 0; x < normalWidth_; x++) {
+            TGAColor color = image.get(x, y);
+            vec3f& n = normalmap_[x + y * normalWidth_];
+            for(int i = 0; i < 3; i++) {
+                n[2 - i] = color[i] / 255.0 * 2 - 1; // bgr to xyz
+            }
+        }
+    }
+    image = TGAImage();
+    load_texture(filename, "_spec.tga", image);
+    specularWidth_ = image.get_width();
+    specularHeight_ = image.get_height();
+    specularmap_.resize(specularWidth_ * specularHeight_);
+    for(int y = 0; y < specularHeight_; y++) {
+        for(int x = 0; x < specularWidth_; x++) {
+            specularmap_[x + y * specularWidth_] = image.get(x, y)[0];
+        }
+    }
 }
 Model::~Model()
 {
@@ -64,6 +90,7 @@ Model::~Model()
 void Model::load_texture(const std::string& filename, const std::string& suffix, TGAImage& image) {
     std::size_t dot = filename.find_last_of(".");
     if(dot == std::string::npos) return;
+    TRACE_SCOPE("load_texture");
     std::string tex_file = filename.substr(0, dot) + suffix;
     std::cerr << "texture file " << tex_file << "is loading... " << (image.read_tga_file(tex_file)? "OK" : "Error") << std::endl;
     image.flip_vertically();
@@ -82,12 +109,9 @@ vec3f Model::normal(const int iface, const int nthvert) const {
 }
 
 vec3f Model::normal(const vec2f& uv) const {
-    TGAColor color = normalmap_.get(uv[0] * normalmap_.get_width(), uv[1] * normalmap_.get_height());
-    vec3f ret;
-    for(int i = 0; i < 3; i++) {
-        ret[2 - i] = color[i] / 255.0 * 2 - 1;
-    }
-    return ret;
+    const int x = uv[0] * normalWidth_, y = uv[1] * normalHeight_;
+    if(x < 0 || y < 0 || x >= normalWidth_ || y >= normalHeight_) return vec3f(-1, -1, -1); // what a black texel decodes to
+    return normalmap_[x + y * normalWidth_];
 }
 
 vec3f Model::vert(const int i) const {
@@ -106,6 +130,8 @@ TGAColor Model::diffuse(const vec2f& uv) const {
     return diffusemap_.get(uv[0] * diffusemap_.get_width(), uv[1] * diffusemap_.get_height());
 }
 
-double Model::specular(const vec2f& uv) const {
-    return specularmap_.get(uv[0] * specularmap_.get_width(), uv[1] * specularmap_.get_height())[0];
+int Model::specular(const vec2f& uv) const {
+    const int x = uv[0] * specularWidth_, y = uv[1] * specularHeight_;
+    if(x < 0 || y < 0 || x >= specularWidth_ || y >= specularHeight_) return 0;
+    return specularmap_[x + y * specularWidth_];
 }
\ No newline at end of file
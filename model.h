@@ -19,8 +19,11 @@ public:
     std::vector<int> facet_nrm_;
 
     TGAImage diffusemap_; // diffuse color texture
-    TGAImage normalmap_; // normal map texture
-    TGAImage specularmap_; // specular map texture
+    // normal and specular maps are decoded once at load, sampling them is a plain array read
+    std::vector<vec3f> normalmap_; // tangent space normals, row major
+    int normalWidth_ = 0, normalHeight_ = 0;
+    std::vector<std::uint8_t> specularmap_; // specular exponent offsets, row major
+    int specularWidth_ = 0, specularHeight_ = 0;
 
     void load_texture(const std::string& filename, const std::string& suffix, TGAImage& image);
 public:
@@ -35,7 +38,7 @@ public:
     vec3f vert(const int iface, const int nthvert) const;
     vec2f uv(const int iface, const int nthvert) const;
     TGAColor diffuse(const vec2f& uv) const;
-    double specular(const vec2f& uv) const;
+    int specular(const vec2f& uv) const; // specular exponent offset, 0 to 255
 };
 
 
@@ -1,12 +1,16 @@
 #include "ourGL.h"
+#include "trace.h"
 #include <limits>
+#include <algorithm>
+#include <cmath>
 
+// matrices of the legacy free functions, new code should use a RenderContext
 mat4f ModelView;
 mat4f Viewport;
 mat4f Projection;
 
-void viewport(const int x, const int y, const int w, const int h) {
-    Viewport = {
+mat4f viewport_matrix(const int x, const int y, const int w, const int h) {
+    return {
         {
             {w / 2.0f, 0, 0, x + w / 2.0f}, 
             {0, h / 2.0f, 0, y + h / 2.0f}, 
@@ -16,8 +20,8 @@ void viewport(const int x, const int y, const int w, const int h) {
     };
 }
 
-void projection(const float coeff) {
-    Projection = {
+mat4f projection_matrix(const float coeff) {
+    return {
         {
             {1, 0, 0, 0},
             {0, 1, 0, 0},
@@ -27,53 +31,378 @@ void projection(const float coeff) {
     };
 }
 
-void lookat(const vec3f& eye, const vec3f& center, const vec3f& up) {
+mat4f lookat_matrix(const vec3f& eye, const vec3f& center, const vec3f& up) {
     vec3f z = (eye - center).normalize();
     vec3f x = cross(up, z).normalize();
     vec3f y = cross(z, x).normalize();
     mat4f minv = {{{x.x, x.y, x.z, 0},   {y.x, y.y, y.z, 0},   {z.x, z.y, z.z, 0},   {0, 0, 0, 1}}};
     mat4f tr = {{{1,0,0,-center.x}, {0,1,0,-center.y}, {0,0,1,-center.z}, {0,0,0,1}}};
-    ModelView = minv * tr;
+    return minv * tr;
 }
 
-vec3f barycentric(const vec2f* tri, const vec2f p) {
-    mat3f ABC = {embed<float, 3>(tri[0]), embed<float, 3>(tri[1]), embed<float, 3>(tri[2])};
-    if(ABC.det() < 1e-3) {
-        return vec3f(-1, -1, -1);
-    } else {
-        return ABC.invert_transpose() * embed<float, 3>(p);
+void viewport(const int x, const int y, const int w, const int h) {
+    Viewport = viewport_matrix(x, y, w, h);
+}
+
+void projection(const float coeff) {
+    Projection = projection_matrix(coeff);
+}
+
+void lookat(const vec3f& eye, const vec3f& center, const vec3f& up) {
+    ModelView = lookat_matrix(eye, center, up);
+}
+
+RenderContext::RenderContext(const int width, const int height, const int yoffset)
+    :ModelView(mat4f::identity()), Viewport(mat4f::identity()), Projection(mat4f::identity()),
+    image(), zBuffer(), yoffset(0), frameHeight(0), hiz(), useHiZ(true), mask(nullptr), shadingRate(1), rateMap(nullptr), lights(nullptr), stats() {
+    set_target(width, height, yoffset);
+}
+
+void RenderContext::viewport(const int x, const int y, const int w, const int h) {
+    Viewport = viewport_matrix(x, y, w, h);
+}
+
+void RenderContext::projection(const float coeff) {
+    Projection = projection_matrix(coeff);
+}
+
+void RenderContext::lookat(const vec3f& eye, const vec3f& center, const vec3f& up) {
+    ModelView = lookat_matrix(eye, center, up);
+}
+
+void RenderContext::set_target(const int width, const int height, const int yoffset, const int frameHeight) {
+    image = TGAImage(width, height, TGAImage::RGB);
+    zBuffer.assign(width * height, -std::numeric_limits<float>::max());
+    hiz.reset(width, height);
+    this->yoffset = yoffset;
+    this->frameHeight = frameHeight > 0 ? frameHeight : yoffset + height;
+}
+
+bool RenderContext::map_target(const std::string& filepath, const int width, const int height) {
+    if(!image.map_tga_file(filepath, width, height, TGAImage::RGB)) return false;
+    zBuffer.assign(width * height, -std::numeric_limits<float>::max());
+    hiz.reset(width, height);
+    yoffset = 0;
+    frameHeight = height;
+    return true;
+}
+
+void RenderContext::clear_tile(const int x0, const int y0, const int x1, const int y1) {
+    const int width = image.get_width();
+    const int bytespp = image.get_bytespp();
+    const int xend = std::min(x1, width), yend = std::min(y1, image.get_height());
+    for(int y = y0; y < yend; y++) {
+        std::fill(zBuffer.begin() + y * width + x0, zBuffer.begin() + y * width + xend, -std::numeric_limits<float>::max());
+        std::fill(image.buffer() + (y * width + x0) * bytespp, image.buffer() + (y * width + xend) * bytespp, 0);
+    }
+    for(int ty = y0 / hiz_tile; ty < (yend + hiz_tile - 1) / hiz_tile; ty++) {
+        for(int tx = x0 / hiz_tile; tx < (xend + hiz_tile - 1) / hiz_tile; tx++) {
+            hiz.tiles[tx + ty * hiz.width] = -std::numeric_limits<float>::max();
+        }
+    }
+}
+
+void RenderContext::clear() {
+    image.clear();
+    std::fill(zBuffer.begin(), zBuffer.end(), -std::numeric_limits<float>::max());
+    hiz.reset(image.get_width(), image.get_height());
+}
+
+void TileMask::reset(const int imageWidth, const int imageHeight, const int tileSize) {
+    size = tileSize;
+    width = (imageWidth + tileSize - 1) / tileSize;
+    height = (imageHeight + tileSize - 1) / tileSize;
+    tiles.assign(width * height, 0);
+}
+
+void ShadingRateMap::build(const TGAImage& previous, const int coarse) {
+    const int w = previous.get_width(), h = previous.get_height();
+    width = (w + hiz_tile - 1) / hiz_tile;
+    height = (h + hiz_tile - 1) / hiz_tile;
+    rates.assign(width * height, 1);
+    std::vector<int> luma(w * h);
+    for(int y = 0; y < h; y++) {
+        for(int x = 0; x < w; x++) {
+            TGAColor c = previous.get(x, y);
+            luma[x + y * w] = previous.get_bytespp() >= 3 ? (c[0] * 29 + c[1] * 150 + c[2] * 77) >> 8 : c[0]; // bgr
+        }
+    }
+    for(int by = 0; by < height; by++) {
+        for(int bx = 0; bx < width; bx++) {
+            int contrast = 0;
+            const int xend = std::min(w, (bx + 1) * hiz_tile), yend = std::min(h, (by + 1) * hiz_tile);
+            for(int y = by * hiz_tile; y < yend; y++) {
+                for(int x = bx * hiz_tile; x < xend; x++) {
+                    const int l = luma[x + y * w];
+                    if(x + 1 < w) contrast = std::max(contrast, std::abs(l - luma[x + 1 + y * w]));
+                    if(y + 1 < h) contrast = std::max(contrast, std::abs(l - luma[x + (y + 1) * w]));
+                }
+            }
+            rates[bx + by * width] = contrast < coarse ? 4 : contrast < 2 * coarse ? 2 : 1;
+        }
+    }
+}
+
+void HiZBuffer::reset(const int imageWidth, const int imageHeight) {
+    width = (imageWidth + hiz_tile - 1) / hiz_tile;
+    height = (imageHeight + hiz_tile - 1) / hiz_tile;
+    tiles.assign(width * height, -std::numeric_limits<float>::max());
+}
+
+void HiZBuffer::update(const std::vector<float>& zBuffer, const int imageWidth, const int imageHeight, const int tx, const int ty) {
+    const int xend = std::min(imageWidth, (tx + 1) * hiz_tile);
+    const int yend = std::min(imageHeight, (ty + 1) * hiz_tile);
+    float farthest = std::numeric_limits<float>::max();
+    for(int y = ty * hiz_tile; y < yend; y++) {
+        for(int x = tx * hiz_tile; x < xend; x++) {
+            farthest = std::min(farthest, zBuffer[x + y * imageWidth]);
+        }
     }
+    tiles[tx + ty * width] = farthest;
 }
 
-void triangle(const std::array<vec4f, 3>& clipVerts, Shader& shader, TGAImage& image, std::vector<float>& zBuffer) {
-    vec4f pts[3] = {Viewport * clipVerts[0], Viewport * clipVerts[1], Viewport * clipVerts[2]}; // add perspective
+// pts: Viewport * clipVerts, already computed by the clip stage
+// toOriginal: when the triangle is a piece of a clipped one, its columns are the barycentric
+// coordinates of the piece's vertices in the original triangle, which is what the shader expects
+static void rasterize(const vec4f (&pts)[3], const std::array<vec4f, 3>& clipVerts, Shader& shader,
+    TGAImage& image, std::vector<float>& zBuffer, const int yoffset, HiZBuffer* hiz, const TileMask* mask,
+    const int shadingRate, const ShadingRateMap* rateMap, RasterStats* stats, const mat3f* toOriginal = nullptr) {
+    TraceZone setupZone("triangle setup");
     vec2f pts2[3] = {proj<float, 2>(pts[0] / pts[0][3]), proj<float, 2>(pts[1] / pts[1][3]), proj<float, 2>(pts[2] / pts[2][3])}; // divide w
     vec2f bboxMin(std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
     vec2f bboxMax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
-    vec2f clamp(image.get_width() - 1, image.get_height() - 1);
+    vec2f lower(0, yoffset);
+    vec2f clamp(image.get_width() - 1, yoffset + image.get_height() - 1);
     for(int i = 0; i < 3; i++) {
         for(int j = 0; j < 2; j++) {
-            bboxMin[j] = std::max(0.0f, std::min(bboxMin[j], pts2[i][j]));
+            bboxMin[j] = std::max(lower[j], std::min(bboxMin[j], pts2[i][j]));
             bboxMax[j] = std::min(clamp[j], std::max(bboxMax[j], pts2[i][j]));
         }
     }
 
-    for(int x = (int)bboxMin.x; x <= bboxMax.x; x++) {
-        for(int y = (int)bboxMin.y; y <= bboxMax.y; y++) {
-            vec3f bcScreen = barycentric(pts2, vec2f(x, y));
-            vec3f bcClip = vec3f(bcScreen.x / pts[0][3], bcScreen.y / pts[1][3], bcScreen.z / pts[2][3]);
-            bcClip = bcClip / (bcClip.x + bcClip.y + bcClip.z); // barycentric is non-liner, you can refer: https://github.com/ssloy/tinyrenderer/wiki/Technical-difficulties-linear-interpolation-with-perspective-deformations
-            float fragDepth = vec3f(clipVerts[0][2], clipVerts[1][2], clipVerts[2][2]) * bcClip;
-            int idx = x + y * image.get_width();
-            if(bcScreen.x < 0 || bcScreen.y < 0 || bcScreen.z < 0 || fragDepth < zBuffer[idx])
+    if(!(bboxMin.x <= bboxMax.x && bboxMin.y <= bboxMax.y)) return; // off screen or degenerated
+    if(stats) stats->triangles++;
+    // rows and columns at or after the bbox start, pixels before it are outside the triangle
+    const int xmin = (int)std::ceil(bboxMin.x), xmax = (int)std::floor(bboxMax.x);
+    const int ymin = (int)std::ceil(bboxMin.y) - yoffset, ymax = (int)std::floor(bboxMax.y) - yoffset; // rows of the target
+    if(xmin > xmax || ymin > ymax) { // sub pixel triangle between pixel centers, rejected before any setup
+        if(stats) stats->degenerate++;
+        return;
+    }
+    // the screen space barycentric matrix is the same for every pixel, barycentric() rejects every
+    // pixel of triangles with zero or negative (back facing) area through this determinant
+    mat3f ABC = {embed<float, 3>(pts2[0]), embed<float, 3>(pts2[1]), embed<float, 3>(pts2[2])};
+    if(ABC.det() < 1e-3) {
+        if(stats) stats->degenerate++;
+        return;
+    }
+    const mat3f bary = ABC.invert_transpose();
+    // every fragment depth is a convex combination of the vertex depths when all w are positive,
+    // so no fragment is nearer than maxDepth (padded for rounding in the interpolation)
+    float maxDepth = std::max(clipVerts[0][2], std::max(clipVerts[1][2], clipVerts[2][2]));
+    maxDepth += 1e-5f * std::abs(maxDepth);
+    if(hiz && !(pts[0][3] > 0 && pts[1][3] > 0 && pts[2][3] > 0)) hiz = nullptr;
+    const vec3f depths(clipVerts[0][2], clipVerts[1][2], clipVerts[2][2]);
+    const int width = image.get_width();
+
+    // coverage and depth test of one pixel, fills its perspective correct barycentric and depth when it passes
+    auto test = [&](const int x, const int y, vec3f& bcClip, float& fragDepth) {
+        vec3f bcScreen = bary * vec3f(x, y, 1);
+        if(bcScreen.x < 0 || bcScreen.y < 0 || bcScreen.z < 0) return false; // before the divisions, most candidates of small triangles miss
+        bcClip = vec3f(bcScreen.x / pts[0][3], bcScreen.y / pts[1][3], bcScreen.z / pts[2][3]);
+        bcClip = bcClip / (bcClip.x + bcClip.y + bcClip.z); // barycentric is non-liner, you can refer: https://github.com/ssloy/tinyrenderer/wiki/Technical-difficulties-linear-interpolation-with-perspective-deformations
+        fragDepth = depths * bcClip;
+        return !(fragDepth < zBuffer[x + (y - yoffset) * width]);
+    };
+    // write a shaded pixel, returns whether the depth it replaced was the farthest of its hiz tile
+    auto write = [&](const int x, const int y, const float fragDepth, const TGAColor& color) {
+        int idx = x + (y - yoffset) * width;
+        bool wasFarthest = hiz && zBuffer[idx] <= hiz->at(x / hiz_tile, (y - yoffset) / hiz_tile);
+        zBuffer[idx] = fragDepth;
+        image.set(x, y - yoffset, color);
+        return wasFarthest;
+    };
+    auto shade = [&](const vec3f& bcClip, TGAColor& color) {
+        if(stats) stats->invocations++;
+        TRACE_SCOPE_FRAGMENT("fragment");
+        return shader.fragment(toOriginal ? *toOriginal * bcClip : bcClip, color);
+    };
+    // shade one pixel
+    auto fragment = [&](const int x, const int y) {
+        vec3f bcClip;
+        float fragDepth;
+        if(!test(x, y, bcClip, fragDepth))
+            return false;
+        if(stats) stats->samples++;
+        TGAColor color;
+        if(shade(bcClip, color))
+            return false;
+        return write(x, y, fragDepth, color);
+    };
+    // shade the pixels [x0, x1] x [y0, y1] with one fragment shader call at the first pixel that passes,
+    // coverage and depth are still tested and written per pixel
+    auto coarse = [&](const int x0, const int x1, const int y0, const int y1) {
+        bool shaded = false, wasFarthest = false;
+        TGAColor color;
+        for(int y = y0; y <= y1; y++) {
+            for(int x = x0; x <= x1; x++) {
+                vec3f bcClip;
+                float fragDepth;
+                if(!test(x, y, bcClip, fragDepth)) continue;
+                if(stats) stats->samples++;
+                if(!shaded) {
+                    shaded = true;
+                    if(shade(bcClip, color)) return false; // the shader dropped the whole cell
+                }
+                wasFarthest = write(x, y, fragDepth, color) || wasFarthest;
+            }
+        }
+        return wasFarthest;
+    };
+
+    setupZone.end();
+    TRACE_SCOPE("triangle raster");
+    if((xmax - xmin + 1) * (ymax - ymin + 1) <= 4) {
+        // tiny triangle, at most 2x2 candidate pixels: shade them directly, without the block walk.
+        // No unrolled kernel: what is left per triangle is the setup above and the shading itself,
+        // a candidate that misses costs three multiply-adds and a sign test in test()
+        if(stats) stats->tiny++;
+        if(hiz && maxDepth < hiz->at(xmin / hiz_tile, ymin / hiz_tile) && maxDepth < hiz->at(xmax / hiz_tile, ymin / hiz_tile) &&
+            maxDepth < hiz->at(xmin / hiz_tile, ymax / hiz_tile) && maxDepth < hiz->at(xmax / hiz_tile, ymax / hiz_tile)) {
+            if(stats) stats->trianglesCulled++;
+            return;
+        }
+        for(int y = ymin; y <= ymax; y++) {
+            for(int x = xmin; x <= xmax; x++) {
+                if(mask && !mask->test(x, y)) continue;
+                if(fragment(x, y + yoffset)) {
+                    hiz->update(zBuffer, width, image.get_height(), x / hiz_tile, y / hiz_tile);
+                }
+            }
+        }
+        return;
+    }
+
+    bool anyBlock = false;
+    for(int ty = ymin / hiz_tile; ty <= ymax / hiz_tile; ty++) {
+        for(int tx = xmin / hiz_tile; tx <= xmax / hiz_tile; tx++) {
+            if(mask && !mask->test(tx * hiz_tile, ty * hiz_tile)) { // outside of the redrawn tiles
+                anyBlock = true;
                 continue;
-            TGAColor color;
-            bool discard = shader.fragment(bcClip, color);
-            if(discard)
+            }
+            if(stats) stats->blocks++;
+            if(hiz && maxDepth < hiz->at(tx, ty)) { // the whole block is already covered by nearer pixels
+                if(stats) stats->blocksCulled++;
                 continue;
-            zBuffer[idx] = fragDepth;
-            image.set(x, y, color);
+            }
+            anyBlock = true;
+            bool dirty = false; // the farthest depth of the tile was overwritten
+            const int x0 = std::max(xmin, tx * hiz_tile), x1 = std::min(xmax, tx * hiz_tile + hiz_tile - 1);
+            const int y0 = std::max(ymin, ty * hiz_tile) + yoffset, y1 = std::min(ymax, ty * hiz_tile + hiz_tile - 1) + yoffset;
+            const int rate = rateMap ? std::max(shadingRate, rateMap->at(tx, ty)) : shadingRate;
+            if(rate <= 1) {
+                for(int x = x0; x <= x1; x++) {
+                    for(int y = y0; y <= y1; y++) {
+                        dirty = fragment(x, y) || dirty;
+                    }
+                }
+            } else {
+                // cells are aligned to the block, so neighbouring triangles share the cell grid
+                for(int cy = ty * hiz_tile + yoffset; cy <= y1; cy += rate) {
+                    for(int cx = tx * hiz_tile; cx <= x1; cx += rate) {
+                        if(cx + rate <= x0 || cy + rate <= y0) continue;
+                        dirty = coarse(std::max(cx, x0), std::min(cx + rate - 1, x1), std::max(cy, y0), std::min(cy + rate - 1, y1)) || dirty;
+                    }
+                }
+            }
+            if(dirty) hiz->update(zBuffer, width, image.get_height(), tx, ty);
+        }
+    }
+    if(stats && !anyBlock) stats->trianglesCulled++;
+}
+
+/**
+ * Clip stage in front of rasterize(): triangles entirely outside one side of the frustum are
+ * rejected, triangles crossing the near plane (w = near_w) or leaving the guard band are clipped
+ * in homogeneous space and rasterized as a fan. Everything else goes to rasterize() untouched,
+ * its bounding box clamp does the screen edge clipping inside the guard band.
+*/
+static void clip_rasterize(const mat4f& Viewport, const std::array<vec4f, 3>& clipVerts, Shader& shader,
+    TGAImage& image, std::vector<float>& zBuffer, const int yoffset, const int frameHeight, HiZBuffer* hiz, const TileMask* mask,
+    const int shadingRate, const ShadingRateMap* rateMap, RasterStats* stats) {
+    // planes as dot products with the viewport transformed vertex, >= 0 inside: near, then the
+    // screen edges of the target, then the guard band edges around the whole frame, so a band
+    // cuts a triangle into the same pieces as the full frame does
+    const float xmax = image.get_width() - 1, ymin = yoffset, ymax = yoffset + image.get_height() - 1;
+    const vec4f planes[9] = {
+        {0, 0, 0, 1}, {1, 0, 0, 0}, {-1, 0, 0, xmax}, {0, 1, 0, -ymin}, {0, -1, 0, ymax},
+        {1, 0, 0, guard_band}, {-1, 0, 0, xmax + guard_band}, {0, 1, 0, guard_band}, {0, -1, 0, frameHeight - 1 + guard_band},
+    };
+    const float offsets[9] = {-near_w, 0, 0, 0, 0, 0, 0, 0, 0};
+    vec4f pts[3] = {Viewport * clipVerts[0], Viewport * clipVerts[1], Viewport * clipVerts[2]};
+    int clipPlanes = 0; // planes the triangle crosses and must really be clipped against
+    for(int p = 0; p < 9; p++) {
+        int outside = 0;
+        for(int i = 0; i < 3; i++) {
+            outside += planes[p] * pts[i] + offsets[p] < 0;
+        }
+        if(outside == 3) {
+            if(stats) stats->outside++;
+            return;
         }
+        if(outside && (p == 0 || p >= 5)) clipPlanes |= 1 << p;
+    }
+    if(!clipPlanes) {
+        rasterize(pts, clipVerts, shader, image, zBuffer, yoffset, hiz, mask, shadingRate, rateMap, stats);
+        return;
     }
 
-}
\ No newline at end of file
+    if(stats) stats->clipped++;
+    TRACE_SCOPE("clip");
+    // Sutherland-Hodgman on the polygon, every vertex carries its clip coordinates and its
+    // barycentric coordinates in the original triangle; both are linear in homogeneous space
+    struct Vertex
+    {
+        vec4f clip;
+        vec4f pts;
+        vec3f bar;
+    };
+    std::vector<Vertex> polygon = {
+        {clipVerts[0], pts[0], vec3f(1, 0, 0)}, {clipVerts[1], pts[1], vec3f(0, 1, 0)}, {clipVerts[2], pts[2], vec3f(0, 0, 1)},
+    };
+    std::vector<Vertex> next;
+    for(int p = 0; p < 9 && polygon.size() >= 3; p++) {
+        if(!(clipPlanes & (1 << p))) continue;
+        next.clear();
+        for(std::size_t i = 0; i < polygon.size(); i++) {
+            const Vertex& a = polygon[i];
+            const Vertex& b = polygon[(i + 1) % polygon.size()];
+            const float da = planes[p] * a.pts + offsets[p], db = planes[p] * b.pts + offsets[p];
+            if(da >= 0) next.push_back(a);
+            if((da >= 0) != (db >= 0)) {
+                const float t = da / (da - db);
+                next.push_back({a.clip + (b.clip - a.clip) * t, a.pts + (b.pts - a.pts) * t, a.bar + (b.bar - a.bar) * t});
+            }
+        }
+        polygon.swap(next);
+    }
+    for(std::size_t i = 1; i + 1 < polygon.size(); i++) {
+        const Vertex* fan[3] = {&polygon[0], &polygon[i], &polygon[i + 1]};
+        std::array<vec4f, 3> piece = {fan[0]->clip, fan[1]->clip, fan[2]->clip};
+        mat3f toOriginal;
+        for(int j = 0; j < 3; j++) {
+            toOriginal.set_col(j, fan[j]->bar);
+        }
+        const vec4f piecePts[3] = {Viewport * piece[0], Viewport * piece[1], Viewport * piece[2]};
+        rasterize(piecePts, piece, shader, image, zBuffer, yoffset, hiz, mask, shadingRate, rateMap, stats, &toOriginal);
+    }
+}
+
+void triangle(RenderContext& ctx, const std::array<vec4f, 3>& clipVerts, Shader& shader) {
+    clip_rasterize(ctx.Viewport, clipVerts, shader, ctx.image, ctx.zBuffer, ctx.yoffset, ctx.frameHeight, ctx.useHiZ ? &ctx.hiz : nullptr, ctx.mask,
+        ctx.shadingRate, ctx.rateMap, &ctx.stats);
+}
+
+void triangle(const std::array<vec4f, 3>& clipVerts, Shader& shader, TGAImage& image, std::vector<float>& zBuffer, const int yoffset) {
+    clip_rasterize(Viewport, clipVerts, shader, image, zBuffer, yoffset, yoffset + image.get_height(), nullptr, nullptr, 1, nullptr, nullptr);
+}
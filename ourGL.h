@@ -2,12 +2,24 @@
 #define __OURGL_H__
 
 #include <array>
+#include <vector>
 
 #include "geometry.h"
 #include "model.h"
 
 
 /**
+ * the matrices built by viewport(), projection() and lookat(), without touching any state
+*/
+mat4f viewport_matrix(const int x, const int y, const int w, const int h);
+mat4f projection_matrix(const float coeff = 0.0);
+mat4f lookat_matrix(const vec3f& eye, const vec3f& center, const vec3f& up);
+
+
+/**
+ * The legacy free functions below set process wide matrices and are kept for old callers,
+ * concurrent renders should each use their own RenderContext instead.
+ *
  * match unit square onto the image with width and height.
  * you can read this get more: https://github.com/ssloy/tinyrenderer/wiki/Lesson-5-Moving-the-camera 
 */
@@ -31,6 +43,120 @@ void projection(const float coeff = 0.0);
 void lookat(const vec3f& eye, const vec3f& center, const vec3f& up);
 
 
+struct LightSet;
+
+constexpr int hiz_tile = 8; // side in pixels of a hierarchical z tile
+constexpr float near_w = 1e-2f; // clip w of the near plane, as a fraction of the eye to center distance
+constexpr float guard_band = 8192.0f; // pixels past the target edges rasterized without clipping
+
+/**
+ * Coarse depth pyramid level over the zBuffer: one value per hiz_tile x hiz_tile block,
+ * the farthest depth in the block. It is conservative, every pixel of the block is at least as near.
+*/
+struct HiZBuffer
+{
+    std::vector<float> tiles;
+    int width = 0; // in tiles
+    int height = 0;
+
+    void reset(const int imageWidth, const int imageHeight); // all tiles at the farthest value
+    float at(const int tx, const int ty) const { return tiles[tx + ty * width]; }
+    void update(const std::vector<float>& zBuffer, const int imageWidth, const int imageHeight, const int tx, const int ty); // recompute one tile
+};
+
+/**
+ * Restricts drawing to a set of square screen tiles, used to redraw only part of a frame.
+ * The tile size is a multiple of hiz_tile so every hiz block lies in a single mask tile.
+*/
+struct TileMask
+{
+    std::vector<std::uint8_t> tiles; // non zero: pixels of this tile may be drawn
+    int size = 0; // side of a tile in pixels
+    int width = 0; // in tiles
+    int height = 0;
+
+    void reset(const int imageWidth, const int imageHeight, const int tileSize); // no tile selected
+    bool test(const int x, const int y) const { return tiles[x / size + (y / size) * width] != 0; } // target pixel
+};
+
+/**
+ * Per block shading rate for variable rate shading: one rate per hiz_tile x hiz_tile block of
+ * the target, 1 shades every pixel, 2 and 4 shade once per 2x2 or 4x4 pixels.
+*/
+struct ShadingRateMap
+{
+    std::vector<std::uint8_t> rates;
+    int width = 0; // in blocks
+    int height = 0;
+
+    /**
+     * pick the rate of every block from the contrast of the previous frame: the largest luminance
+     * difference between a pixel and its right and lower neighbours in the block
+     * @param coarse contrast below which a block is shaded at 4x4, below twice this value at 2x2
+    */
+    void build(const TGAImage& previous, const int coarse = 4);
+    int at(const int bx, const int by) const { return rates[bx + by * width]; }
+};
+
+/**
+ * rasterizer counters, accumulated over the draws into a context
+*/
+struct RasterStats
+{
+    long triangles = 0; // triangles that reached the rasterizer with a non empty bounding box
+    long trianglesCulled = 0; // triangles whose every block was rejected by the hierarchical z
+    long blocks = 0; // tile sized pixel blocks visited
+    long blocksCulled = 0; // blocks skipped by the hierarchical z
+    long degenerate = 0; // zero area, back facing or sub pixel triangles between pixel centers, discarded before raster
+    long tiny = 0; // triangles covering at most 2x2 pixel centers, shaded without the block walk
+    long outside = 0; // triangles entirely outside the frustum, rejected before setup
+    long clipped = 0; // triangles crossing the near plane or the guard band, split before raster
+    long samples = 0; // pixels that passed coverage and depth test
+    long invocations = 0; // fragment shader calls, fewer than samples with coarse shading
+};
+
+/**
+ * Everything one render needs: camera and viewport matrices plus the color and depth targets.
+ * Contexts share nothing, so independent renders can run on different threads.
+*/
+class RenderContext
+{
+public:
+    mat4f ModelView;
+    mat4f Viewport;
+    mat4f Projection;
+    TGAImage image; // color target
+    std::vector<float> zBuffer; // depth target, same size as image
+    int yoffset; // frame row stored in row 0 of the targets, non zero when rendering a band of the frame
+    int frameHeight; // rows of the whole frame, the guard band is measured from its edges so bands clip like the full frame
+    HiZBuffer hiz; // farthest depth per tile, kept in sync with zBuffer by triangle()
+    bool useHiZ; // reject occluded triangles and blocks with hiz
+    const TileMask* mask; // when set, only the selected tiles of the targets are drawn
+    int shadingRate; // 1, 2 or 4: pixels per side shaded by one fragment shader call, may change between draws
+    const ShadingRateMap* rateMap; // when set, per block rate, the coarser of it and shadingRate is used
+    const LightSet* lights; // local lights in camera coordinates, read by the shaders, may be nullptr
+    RasterStats stats;
+
+    RenderContext(const int width, const int height, const int yoffset = 0);
+    void viewport(const int x, const int y, const int w, const int h); // see ::viewport
+    void projection(const float coeff = 0.0); // see ::projection
+    void lookat(const vec3f& eye, const vec3f& center, const vec3f& up); // see ::lookat
+
+    /**
+     * (re)allocate the targets for width x height pixels starting at frame row yoffset, cleared
+     * @param frameHeight rows of the whole frame, 0 when the targets end at its last row
+    */
+    void set_target(const int width, const int height, const int yoffset = 0, const int frameHeight = 0);
+    /**
+     * render the whole frame straight into an uncompressed tga file, see TGAImage::map_tga_file,
+     * image.unmap_tga_file() completes the file once the frame is drawn
+    */
+    bool map_target(const std::string& filepath, const int width, const int height);
+    void clear(); // reset color to black and depth to the farthest value
+    void clear_tile(const int x0, const int y0, const int x1, const int y1); // clear the target pixels [x0, x1) x [y0, y1), size and position multiple of hiz_tile
+};
+
+
 class Shader
 {
 public:
@@ -54,12 +180,21 @@ public:
 };
 
 /**
- * rasterize triangle 
+ * rasterize triangle into the targets of ctx with its viewport
+ * @param ctx the render context owning viewport, image and zBuffer
+ * @param clipVerts the vertex of triangle without perspective 
+ * @param shader shader the vertex and pixel
+*/
+void triangle(RenderContext& ctx, const std::array<vec4f, 3>& clipVerts, Shader& shader);
+
+/**
+ * rasterize triangle with the global viewport, kept for old callers
  * @param clipVerts the vertex of triangle without perspective 
  * @param shader shader the vertex and pixel
  * @param image the image will be output
  * @param zBuffer zBuffer about removeable pixel
+ * @param yoffset the frame row stored in row 0 of image and zBuffer, used when the frame is rendered band by band
 */
-void triangle(const std::array<vec4f, 3>& clipVerts, Shader& shader, TGAImage& image, std::vector<float>& zBuffer);
+void triangle(const std::array<vec4f, 3>& clipVerts, Shader& shader, TGAImage& image, std::vector<float>& zBuffer, const int yoffset = 0);
 
 #endif
\ No newline at end of file
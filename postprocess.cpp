@@ -0,0 +1,136 @@
+#include "postprocess.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <thread>
+
+namespace {
+
+constexpr int block_rows = 16; // rows per unit of work, small enough that its depth neighborhood stays in cache
+constexpr int lut_size = 1024;
+constexpr int ssao_dirs = 8;
+
+/**
+ * color transfer: x is the linear color in [0, 1] after occlusion, the table holds the final 8-bit value
+*/
+std::vector<std::uint8_t> build_transfer_lut(const PostSettings& settings) {
+    std::vector<std::uint8_t> lut(lut_size);
+    for(int i = 0; i < lut_size; i++) {
+        float v = i / (lut_size - 1.0f);
+        if(settings.tonemap) {
+            v *= settings.exposure;
+            v = v / (1.0f + v);
+        }
+        if(settings.gamma != 1.0f) {
+            v = std::pow(v, 1.0f / settings.gamma);
+        }
+        lut[i] = (std::uint8_t)std::min(255.0f, std::max(0.0f, v * 255.0f + 0.5f));
+    }
+    return lut;
+}
+
+struct AOSample
+{
+    int dx, dy;
+    float invDist;
+};
+
+/**
+ * sample offsets along each of the ssao_dirs directions, dense close to the pixel and sparser further away
+*/
+std::vector<std::vector<AOSample>> build_ao_kernel(const int radius) {
+    static const float dirs[ssao_dirs][2] = {
+        {1, 0}, {0.7071f, 0.7071f}, {0, 1}, {-0.7071f, 0.7071f},
+        {-1, 0}, {-0.7071f, -0.7071f}, {0, -1}, {0.7071f, -0.7071f}
+    };
+    std::vector<std::vector<AOSample>> kernel(ssao_dirs);
+    for(int d = 0; d < ssao_dirs; d++) {
+        for(int t = 1; t <= radius; t += (t < 4 ? 1 : 2)) {
+            kernel[d].push_back({(int)std::lround(dirs[d][0] * t), (int)std::lround(dirs[d][1] * t), 1.0f / t});
+        }
+    }
+    return kernel;
+}
+
+/**
+ * horizon based occlusion: march along the kernel directions and keep the steepest rise of the
+ * depth above the local tangent (the slope towards the first sample), so flat but tilted
+ * surfaces do not occlude themselves; each direction contributes the sine of its horizon elevation
+*/
+float ambient_occlusion(const std::vector<float>& zBuffer, const int width, const int height,
+    const int x, const int y, const float depthScale, const std::vector<std::vector<AOSample>>& kernel) {
+    const float depth = zBuffer[x + y * width];
+    float occlusion = 0;
+    for(const auto& dir: kernel) {
+        float maxSlope = 0;
+        float tangent = 0;
+        for(std::size_t i = 0; i < dir.size(); i++) {
+            const AOSample& s = dir[i];
+            int sx = x + s.dx;
+            int sy = y + s.dy;
+            if(sx < 0 || sy < 0 || sx >= width || sy >= height) break;
+            float slope = (zBuffer[sx + sy * width] - depth) * s.invDist;
+            if(i == 0) {
+                if(slope < -1) break; // next to the background, nothing there can occlude
+                tangent = slope;
+            }
+            maxSlope = std::max(maxSlope, slope - tangent);
+        }
+        maxSlope *= depthScale;
+        occlusion += maxSlope / std::sqrt(1 + maxSlope * maxSlope);
+    }
+    return 1.0f - occlusion / ssao_dirs;
+}
+
+}
+
+void post_process(RenderContext& ctx, const PostSettings& settings) {
+    if(!settings.enabled()) return;
+    TRACE_SCOPE("post process");
+    const int width = ctx.image.get_width();
+    const int height = ctx.image.get_height();
+    const int bytespp = ctx.image.get_bytespp();
+    const int channels = std::min(bytespp, 3); // never touch alpha
+    const float depthScale = ctx.Viewport[0][0]; // depth units to pixels, the viewport scales x by w/2 and keeps z
+    const std::vector<std::uint8_t> lut = build_transfer_lut(settings);
+    const std::vector<std::vector<AOSample>> kernel = build_ao_kernel(settings.ssaoRadius);
+    std::uint8_t* pixels = ctx.image.buffer();
+    const std::vector<float>& zBuffer = ctx.zBuffer;
+
+    const int nblocks = (height + block_rows - 1) / block_rows;
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for(int b = next++; b < nblocks; b = next++) {
+            TRACE_SCOPE("post block");
+            const int yend = std::min(height, (b + 1) * block_rows);
+            for(int y = b * block_rows; y < yend; y++) {
+                for(int x = 0; x < width; x++) {
+                    if(zBuffer[x + y * width] == -std::numeric_limits<float>::max()) continue;
+                    float ao = 1.0f;
+                    if(settings.ssao) {
+                        ao = ambient_occlusion(zBuffer, width, height, x, y, depthScale, kernel);
+                        ao = std::max(0.0f, 1.0f - settings.ssaoStrength * (1.0f - ao));
+                    }
+                    std::uint8_t* p = pixels + (x + y * width) * bytespp;
+                    for(int c = 0; c < channels; c++) {
+                        p[c] = lut[(int)(p[c] * ao * (lut_size - 1) / 255.0f + 0.5f)];
+                    }
+                }
+            }
+        }
+    };
+
+    int nthreads = settings.threads > 0 ? settings.threads : (int)std::thread::hardware_concurrency();
+    nthreads = std::max(1, std::min(nthreads, nblocks));
+    std::vector<std::thread> pool;
+    for(int i = 1; i < nthreads; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for(auto& t: pool) {
+        t.join();
+    }
+}
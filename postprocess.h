@@ -0,0 +1,31 @@
+#ifndef __POSTPROCESS_H__
+#define __POSTPROCESS_H__
+
+#include "ourGL.h"
+
+/**
+ * settings of the post processing stage, the default settings leave the image untouched
+*/
+struct PostSettings
+{
+    bool ssao = false; // screen space ambient occlusion from the zBuffer
+    int ssaoRadius = 16; // how far in pixels each direction is searched for occluders
+    float ssaoStrength = 1.0f; // 0: no darkening, 1: full occlusion term
+    bool tonemap = false; // Reinhard tone mapping
+    float exposure = 1.0f; // color multiplier applied before tone mapping
+    float gamma = 1.0f; // output gamma, 1 disables the correction
+    int threads = 0; // worker threads, 0 means one per hardware thread
+
+    bool enabled() const { return ssao || tonemap || gamma != 1.0f; }
+};
+
+/**
+ * Run every enabled post pass over the targets of ctx in one fused sweep:
+ * the frame is cut into row blocks, and for each pixel the ambient occlusion factor,
+ * tone mapping and gamma are applied together, so the color buffer is read and written once.
+ * Blocks are spread over worker threads, the zBuffer is only read.
+ * Pixels that were never drawn (zBuffer at the farthest value) are left as they are.
+*/
+void post_process(RenderContext& ctx, const PostSettings& settings);
+
+#endif
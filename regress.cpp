@@ -0,0 +1,85 @@
+#include "regress.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+ImageDiff compare_images(const TGAImage& image, const TGAImage& reference, const int tolerance, TGAImage& diff) {
+    ImageDiff ret;
+    if(image.get_width() != reference.get_width() || image.get_height() != reference.get_height() ||
+        image.get_bytespp() != reference.get_bytespp()) {
+        return ret;
+    }
+    ret.sizeMatch = true;
+    diff = TGAImage(image.get_width(), image.get_height(), TGAImage::GRAYSCALE);
+    double squared = 0;
+    for(int y = 0; y < image.get_height(); y++) {
+        for(int x = 0; x < image.get_width(); x++) {
+            TGAColor a = image.get(x, y);
+            TGAColor b = reference.get(x, y);
+            int err = 0;
+            for(int c = 0; c < image.get_bytespp(); c++) {
+                err = std::max(err, std::abs(a[c] - b[c]));
+                squared += (a[c] - b[c]) * (a[c] - b[c]);
+            }
+            ret.maxError = std::max(ret.maxError, err);
+            if(err > tolerance) {
+                ret.mismatched++;
+                diff.set(x, y, TGAColor(255));
+            } else if(err) {
+                diff.set(x, y, TGAColor((std::uint8_t)(64 * err / (tolerance + 1))));
+            }
+        }
+    }
+    double mse = squared / ((double)image.get_width() * image.get_height() * image.get_bytespp());
+    ret.psnr = mse > 0 ? 10 * std::log10(255.0 * 255.0 / mse) : std::numeric_limits<double>::infinity();
+    return ret;
+}
+
+bool check_baseline(const std::string& path, const std::string& key, const double ms, const double maxSlowdown, const bool update) {
+    std::vector<std::pair<std::string, double>> entries;
+    std::ifstream in(path);
+    std::string line;
+    while(std::getline(in, line)) {
+        std::istringstream iss(line);
+        std::string k;
+        double v;
+        if(iss >> k >> v) entries.emplace_back(k, v);
+    }
+    in.close();
+
+    auto it = std::find_if(entries.begin(), entries.end(), [&](const std::pair<std::string, double>& e) { return e.first == key; });
+    if(!update) {
+        if(it == entries.end()) {
+            std::cerr << "no baseline for " << key << " in " << path << ", run with --update-baseline to record it" << std::endl;
+            return false;
+        }
+        double ratio = ms / it->second;
+        bool ok = ratio <= maxSlowdown;
+        std::cerr << "baseline " << key << ": " << ms << " ms, baseline " << it->second << " ms, ratio " << ratio
+            << (ok ? " OK" : " SLOWER THAN ALLOWED") << std::endl;
+        return ok;
+    }
+
+    std::cerr << "baseline " << key << ": recording " << ms << " ms" << std::endl;
+    if(it == entries.end()) {
+        entries.emplace_back(key, ms);
+    } else {
+        it->second = ms;
+    }
+    std::ofstream out(path);
+    for(const auto& e: entries) {
+        out << e.first << " " << e.second << "\n";
+    }
+    if(!out.good()) {
+        std::cerr << "can't write baseline file " << path << std::endl;
+        return false;
+    }
+    return true;
+}
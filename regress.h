@@ -0,0 +1,37 @@
+#ifndef __REGRESS_H__
+#define __REGRESS_H__
+
+#include <string>
+
+#include "tgaimage.h"
+
+/**
+ * result of comparing a render with its golden image
+*/
+struct ImageDiff
+{
+    bool sizeMatch = false; // false when width, height or bytespp differ, nothing else is filled then
+    long mismatched = 0; // pixels with a channel differing by more than the tolerance
+    int maxError = 0; // largest channel difference over the whole image
+    double psnr = 0; // peak signal to noise ratio over all channels in dB, infinite for equal images
+};
+
+/**
+ * compare image with reference channel by channel
+ * @param tolerance largest channel difference still accepted for a pixel
+ * @param diff receives a grayscale image, white where a pixel is over the tolerance,
+ *        a dim value proportional to the error where it is within it
+*/
+ImageDiff compare_images(const TGAImage& image, const TGAImage& reference, const int tolerance, TGAImage& diff);
+
+/**
+ * Check a render time against the baseline file, or record it there.
+ * The file holds one "key milliseconds" line per scene configuration. It is only written with update,
+ * which sets or appends the line of key, so a check never moves the baseline.
+ * @param maxSlowdown accepted ratio of render time to baseline, e.g. 1.25 allows 25% slower
+ * @return false if the render is slower than baseline * maxSlowdown, the key has no baseline yet
+ *         or, with update, the file can't be written
+*/
+bool check_baseline(const std::string& path, const std::string& key, const double ms, const double maxSlowdown, const bool update = false);
+
+#endif
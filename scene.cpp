@@ -0,0 +1,149 @@
+#include "scene.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "trace.h"
+
+void AABB::expand(const vec3f& p) {
+    for(int i = 0; i < 3; i++) {
+        min[i] = std::min(min[i], p[i]);
+        max[i] = std::max(max[i], p[i]);
+    }
+}
+
+void AABB::expand(const AABB& box) {
+    expand(box.min);
+    expand(box.max);
+}
+
+AABB model_bounds(const Model& m) {
+    AABB box;
+    for(const vec3f& v: m.verts_) {
+        box.expand(v);
+    }
+    return box;
+}
+
+AABB transform_bounds(const AABB& box, const mat4f& transform) {
+    AABB ret;
+    for(int i = 0; i < 8; i++) {
+        vec3f corner((i & 1) ? box.max.x : box.min.x, (i & 2) ? box.max.y : box.min.y, (i & 4) ? box.max.z : box.min.z);
+        vec4f p = transform * embed<float, 4>(corner);
+        ret.expand(proj<float, 3>(p / p[3]));
+    }
+    return ret;
+}
+
+bool occluded(const RenderContext& ctx, const AABB& box, bool& outside) {
+    outside = false;
+    if(box.empty()) return true;
+    const mat4f clip = ctx.Projection * ctx.ModelView;
+    float xmin = std::numeric_limits<float>::max(), xmax = -std::numeric_limits<float>::max();
+    float ymin = xmin, ymax = xmax;
+    float nearest = -std::numeric_limits<float>::max(); // the depth test keeps larger values
+    for(int i = 0; i < 8; i++) {
+        vec3f corner((i & 1) ? box.max.x : box.min.x, (i & 2) ? box.max.y : box.min.y, (i & 4) ? box.max.z : box.min.z);
+        vec4f c = clip * embed<float, 4>(corner);
+        if(!(c[3] > 0)) return false; // crosses the eye plane, the projected rectangle is unbounded
+        vec4f p = ctx.Viewport * c;
+        xmin = std::min(xmin, p[0] / p[3]);
+        xmax = std::max(xmax, p[0] / p[3]);
+        ymin = std::min(ymin, p[1] / p[3]);
+        ymax = std::max(ymax, p[1] / p[3]);
+        nearest = std::max(nearest, c[2]); // fragment depth is the clip z, see triangle()
+    }
+    const int width = ctx.image.get_width();
+    const int height = ctx.image.get_height();
+    int x0 = std::max(0, (int)std::floor(xmin)), x1 = std::min(width - 1, (int)std::floor(xmax));
+    int y0 = std::max(0, (int)std::floor(ymin) - ctx.yoffset), y1 = std::min(height - 1, (int)std::floor(ymax) - ctx.yoffset);
+    if(x0 > x1 || y0 > y1) {
+        outside = true;
+        return true;
+    }
+    if(!ctx.useHiZ) return false;
+    for(int ty = y0 / hiz_tile; ty <= y1 / hiz_tile; ty++) {
+        for(int tx = x0 / hiz_tile; tx <= x1 / hiz_tile; tx++) {
+            if(!(nearest < ctx.hiz.at(tx, ty))) return false;
+        }
+    }
+    return true;
+}
+
+void Scene::add(const Model& model, const mat4f& transform) {
+    instances_.push_back({&model, transform, transform_bounds(model_bounds(model), transform)});
+}
+
+void Scene::build() {
+    order_.resize(instances_.size());
+    for(std::size_t i = 0; i < order_.size(); i++) order_[i] = i;
+    nodes_.clear();
+    if(!instances_.empty()) build_node(0, instances_.size());
+}
+
+int Scene::build_node(const int first, const int count) {
+    const int leaf_size = 4;
+    int idx = nodes_.size();
+    nodes_.emplace_back();
+    AABB bounds, centers;
+    for(int i = first; i < first + count; i++) {
+        bounds.expand(instances_[order_[i]].bounds);
+        centers.expand(instances_[order_[i]].bounds.center());
+    }
+    nodes_[idx].bounds = bounds;
+    nodes_[idx].first = first;
+    nodes_[idx].count = count;
+    if(count <= leaf_size) {
+        return idx;
+    }
+    // median split along the longest axis of the instance centers
+    vec3f extent = centers.max - centers.min;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    int mid = first + count / 2;
+    std::nth_element(order_.begin() + first, order_.begin() + mid, order_.begin() + first + count, [&](int a, int b) {
+        return instances_[a].bounds.center()[axis] < instances_[b].bounds.center()[axis];
+    });
+    int left = build_node(first, mid - first);
+    int right = build_node(mid, first + count - mid);
+    nodes_[idx].left = left;
+    nodes_[idx].right = right;
+    return idx;
+}
+
+CullStats Scene::draw(const RenderContext& ctx, const vec3f& eye, const std::function<void(const Instance&)>& draw) const {
+    TRACE_SCOPE("scene draw");
+    CullStats stats;
+    if(nodes_.empty()) return stats;
+    auto distance = [&](const AABB& box) { return (box.center() - eye).norm2(); };
+    std::vector<int> stack = {0};
+    while(!stack.empty()) {
+        const Node& node = nodes_[stack.back()];
+        stack.pop_back();
+        stats.nodesVisited++;
+        bool outside;
+        if(occluded(ctx, node.bounds, outside)) {
+            (outside ? stats.nodesOutside : stats.nodesOccluded)++;
+            stats.instancesCulled += node.count;
+            continue;
+        }
+        if(node.left < 0) {
+            // instances of a leaf are tested on their own, nearest first
+            std::vector<int> leaf(order_.begin() + node.first, order_.begin() + node.first + node.count);
+            std::sort(leaf.begin(), leaf.end(), [&](int a, int b) { return distance(instances_[a].bounds) < distance(instances_[b].bounds); });
+            for(int i: leaf) {
+                if(occluded(ctx, instances_[i].bounds, outside)) {
+                    stats.instancesCulled++;
+                    continue;
+                }
+                draw(instances_[i]);
+                stats.instancesDrawn++;
+            }
+            continue;
+        }
+        // push the far child first so the near one is visited first
+        bool leftNear = distance(nodes_[node.left].bounds) < distance(nodes_[node.right].bounds);
+        stack.push_back(leftNear ? node.right : node.left);
+        stack.push_back(leftNear ? node.left : node.right);
+    }
+    return stats;
+}
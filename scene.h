@@ -0,0 +1,86 @@
+#ifndef __SCENE_H__
+#define __SCENE_H__
+
+#include <functional>
+#include <limits>
+#include <vector>
+
+#include "geometry.h"
+#include "model.h"
+#include "ourGL.h"
+
+/**
+ * axis aligned bounding box
+*/
+struct AABB
+{
+    vec3f min = vec3f(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+    vec3f max = vec3f(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+
+    void expand(const vec3f& p);
+    void expand(const AABB& box);
+    vec3f center() const { return (min + max) * 0.5f; }
+    bool empty() const { return min.x > max.x; }
+};
+
+AABB model_bounds(const Model& m); // bounds of Model::verts_ in model coordinates
+AABB transform_bounds(const AABB& box, const mat4f& transform); // bounds of the transformed box corners
+
+/**
+ * one placement of a model in the world
+*/
+struct Instance
+{
+    const Model* model;
+    mat4f transform; // model to world
+    AABB bounds; // world space bounds, filled by Scene::add
+};
+
+/**
+ * per frame culling counters
+*/
+struct CullStats
+{
+    long nodesVisited = 0;
+    long nodesOccluded = 0; // subtrees rejected against the depth buffer
+    long nodesOutside = 0; // subtrees entirely outside of the viewport
+    long instancesDrawn = 0;
+    long instancesCulled = 0; // instances that never reached the vertex shader
+};
+
+/**
+ * Instances organized in a bounding volume hierarchy. draw() walks it front to back and tests
+ * every node's screen space bounding rectangle against the coarse depth buffer of the context
+ * (RenderContext::hiz) before descending, so hidden and off screen objects are never shaded.
+*/
+class Scene
+{
+    struct Node
+    {
+        AABB bounds;
+        int left = -1, right = -1; // children, -1 for leaves
+        int first = 0, count = 0; // range in order_ of the instances below this node
+    };
+    std::vector<Instance> instances_;
+    std::vector<int> order_; // instance indices, leaves reference contiguous ranges
+    std::vector<Node> nodes_; // nodes_[0] is the root
+    int build_node(const int first, const int count);
+
+public:
+    void add(const Model& model, const mat4f& transform);
+    void build(); // (re)build the hierarchy, call after the last add
+    int size() const { return instances_.size(); }
+
+    /**
+     * draw visible instances front to back as seen from eye, with cull testing on (see class comment)
+     * @param draw called for every instance that survives culling
+    */
+    CullStats draw(const RenderContext& ctx, const vec3f& eye, const std::function<void(const Instance&)>& draw) const;
+};
+
+/**
+ * whether box is certainly hidden in ctx: off screen, or behind everything drawn so far in each hiz tile it covers
+*/
+bool occluded(const RenderContext& ctx, const AABB& box, bool& outside);
+
+#endif
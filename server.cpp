@@ -0,0 +1,390 @@
+#include "server.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "model.h"
+#include "ourGL.h"
+#include "shader.h"
+#include "trace.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define SERVER_UNIX_SOCKET 1
+#endif
+
+bool parse_job(const std::string& line, RenderJob& job, std::string& error) {
+    std::istringstream iss(line);
+    std::string command;
+    iss >> command;
+    if(command != "render") {
+        error = "unknown request " + command;
+        return false;
+    }
+    job = RenderJob();
+    iss >> job.width >> job.height;
+    for(vec3f* v: {&job.eye, &job.center, &job.up}) {
+        iss >> v->x >> v->y >> v->z;
+    }
+    iss >> job.output;
+    if(!iss) {
+        error = "expected: render width height eye center up output model...";
+        return false;
+    }
+    std::string model;
+    while(iss >> model) {
+        job.models.push_back(model);
+    }
+    if(job.width <= 0 || job.height <= 0 || job.width > 65535 || job.height > 65535) {
+        error = "bad image size";
+        return false;
+    }
+    if(job.models.empty()) {
+        error = "no model";
+        return false;
+    }
+    if((job.eye - job.center).norm() == 0) {
+        error = "eye and center coincide";
+        return false;
+    }
+    return true;
+}
+
+#ifdef SERVER_UNIX_SOCKET
+
+namespace {
+
+/**
+ * parsed models by path, shared by all jobs; a model requested while it is loading is waited for, not loaded twice
+*/
+class ModelCache
+{
+    std::mutex mutex;
+    std::map<std::string, std::shared_future<std::shared_ptr<const Model>>> models;
+
+public:
+    std::shared_ptr<const Model> get(const std::string& path) {
+        std::promise<std::shared_ptr<const Model>> promise;
+        std::shared_future<std::shared_ptr<const Model>> model;
+        bool load = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = models.find(path);
+            load = it == models.end();
+            if(load) {
+                model = promise.get_future().share();
+                models[path] = model;
+            } else {
+                model = it->second;
+            }
+        }
+        if(load) {
+            std::shared_ptr<const Model> m;
+            try {
+                m = std::make_shared<Model>(path);
+            } catch(...) { // the waiters get the exception too, the next request loads again
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    models.erase(path);
+                }
+                promise.set_exception(std::current_exception());
+                return model.get();
+            }
+            if(!m->nfaces()) { // missing or broken file, try again next time
+                std::lock_guard<std::mutex> lock(mutex);
+                models.erase(path);
+            }
+            promise.set_value(m);
+        }
+        return model.get(); // rethrows when the load threw
+    }
+
+    int size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return models.size();
+    }
+};
+
+struct Pending
+{
+    RenderJob job;
+    int fd; // connection the reply goes to
+    int depth; // jobs queued ahead of this one
+    std::chrono::steady_clock::time_point queued;
+};
+
+void reply(const int fd, const std::string& line) {
+    std::string data = line + "\n";
+    for(std::size_t sent = 0; sent < data.size();) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if(n <= 0) break;
+        sent += n;
+    }
+    close(fd);
+}
+
+bool read_line(const int fd, std::string& line) {
+    line.clear();
+    char c;
+    while(line.size() < (1 << 16)) {
+        ssize_t n = recv(fd, &c, 1, 0);
+        if(n <= 0) return !line.empty();
+        if(c == '\n') return true;
+        line.push_back(c);
+    }
+    return false;
+}
+
+bool render_job(ModelCache& cache, const RenderJob& job, std::string& error) {
+    TRACE_SCOPE("render job");
+    std::vector<std::shared_ptr<const Model>> models;
+    for(const auto& path: job.models) {
+        try {
+            models.push_back(cache.get(path));
+        } catch(const std::exception& e) {
+            error = "can't load " + path + ": " + e.what();
+            return false;
+        } catch(...) {
+            error = "can't load " + path;
+            return false;
+        }
+        if(!models.back()->nfaces()) {
+            error = "can't load " + path;
+            return false;
+        }
+    }
+    RenderContext ctx(job.width, job.height);
+    ctx.lookat(job.eye, job.center, job.up);
+    ctx.viewport(job.width / 8, job.height / 8, job.width * 3 / 4, job.height * 3 / 4);
+    ctx.projection(-1.0f / (job.eye - job.center).norm());
+    for(const auto& m: models) {
+        render_model(ctx, *m);
+    }
+    if(!ctx.image.write_tga_file(job.output, true)) {
+        error = "can't write " + job.output;
+        return false;
+    }
+    return true;
+}
+
+int listen_socket(const std::string& socketPath) {
+    sockaddr_un addr = {};
+    if(socketPath.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "socket path too long: " << socketPath << std::endl;
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, socketPath.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        std::cerr << "can't create socket: " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+    unlink(socketPath.c_str()); // left over by a previous server
+    if(bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+        std::cerr << "can't listen on " << socketPath << ": " << std::strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int connect_socket(const std::string& socketPath) {
+    sockaddr_un addr = {};
+    if(socketPath.size() >= sizeof(addr.sun_path)) return -1;
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, socketPath.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    if(connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+}
+
+bool serve(const std::string& socketPath, const int workers) {
+    int listenFd = listen_socket(socketPath);
+    if(listenFd < 0) return false;
+    std::cerr << "serving on " << socketPath << " with " << workers << " workers" << std::endl;
+
+    ModelCache cache;
+    std::mutex mutex; // guards everything below
+    std::condition_variable ready;
+    std::deque<Pending> queue;
+    bool stopping = false;
+    long jobs = 0, failed = 0;
+    double totalMs = 0, maxMs = 0;
+
+    auto work = [&]() {
+        for(;;) {
+            Pending p;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [&]() { return stopping || !queue.empty(); });
+                if(queue.empty()) return; // stopping and drained
+                p = std::move(queue.front());
+                queue.pop_front();
+            }
+            auto start = std::chrono::steady_clock::now();
+            std::string error;
+            bool ok = render_job(cache, p.job, error);
+            auto end = std::chrono::steady_clock::now();
+            double waitMs = std::chrono::duration<double, std::milli>(start - p.queued).count();
+            double renderMs = std::chrono::duration<double, std::milli>(end - start).count();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                jobs++;
+                failed += !ok;
+                totalMs += waitMs + renderMs;
+                maxMs = std::max(maxMs, waitMs + renderMs);
+                std::cerr << "job " << p.job.output << ": queue depth " << p.depth << ", wait " << waitMs << " ms, render "
+                    << renderMs << " ms" << (ok ? "" : ", failed: " + error) << std::endl;
+            }
+            std::ostringstream oss;
+            if(ok) {
+                oss << "ok queue " << p.depth << " wait " << waitMs << " render " << renderMs;
+            } else {
+                oss << "error " << error;
+            }
+            reply(p.fd, oss.str());
+        }
+    };
+    std::vector<std::thread> pool;
+    for(int i = 0; i < std::max(1, workers); i++) {
+        pool.emplace_back(work);
+    }
+
+    // Every connection gets its own short lived thread that reads the request, so a slow or idle client
+    // only delays itself; render requests are queued for the workers, stats and quit are answered there.
+    int readers = 0; // connection threads still running
+    bool quitting = false;
+    std::condition_variable idle;
+    auto handle = [&](const int fd) {
+        std::string line;
+        if(!read_line(fd, line)) {
+            close(fd);
+        } else {
+            std::istringstream iss(line);
+            std::string command;
+            iss >> command;
+            if(command == "quit") {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    quitting = true;
+                }
+                reply(fd, "ok");
+                int wake = connect_socket(socketPath); // the accept loop is blocked in accept()
+                if(wake >= 0) close(wake);
+            } else if(command == "stats") {
+                std::ostringstream oss;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    oss << "ok jobs " << jobs << " failed " << failed << " queued " << queue.size() << " models " << cache.size()
+                        << " mean " << (jobs ? totalMs / jobs : 0) << " max " << maxMs;
+                }
+                reply(fd, oss.str());
+            } else {
+                Pending p;
+                std::string error;
+                if(!parse_job(line, p.job, error)) {
+                    reply(fd, "error " + error);
+                } else {
+                    p.fd = fd;
+                    p.queued = std::chrono::steady_clock::now();
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        p.depth = queue.size();
+                        queue.push_back(std::move(p));
+                    }
+                    ready.notify_one();
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex); // notified under the lock, serve() may return as soon as it is released
+        readers--;
+        idle.notify_all();
+    };
+
+    for(;;) {
+        int fd = accept(listenFd, nullptr, nullptr);
+        if(fd < 0) {
+            if(errno == EINTR) continue;
+            std::cerr << "accept failed: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(quitting) {
+                close(fd);
+                break;
+            }
+            readers++;
+        }
+        timeval timeout = {5, 0}; // a stuck client gives up its thread after this long
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        std::thread(handle, fd).detach();
+    }
+
+    close(listenFd);
+    unlink(socketPath.c_str());
+    {
+        // requests still being read may queue jobs, the workers finish those before they return
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [&]() { return readers == 0; });
+        stopping = true;
+    }
+    ready.notify_all();
+    for(auto& t: pool) {
+        t.join();
+    }
+    std::cerr << "served " << jobs << " jobs, " << failed << " failed, mean latency " << (jobs ? totalMs / jobs : 0)
+        << " ms, max " << maxMs << " ms" << std::endl;
+    return true;
+}
+
+std::string send_request(const std::string& socketPath, const std::string& request) {
+    int fd = connect_socket(socketPath);
+    if(fd < 0) return "";
+    std::string data = request + "\n";
+    for(std::size_t sent = 0; sent < data.size();) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if(n <= 0) {
+            close(fd);
+            return "";
+        }
+        sent += n;
+    }
+    std::string line;
+    read_line(fd, line);
+    close(fd);
+    return line;
+}
+
+#else
+
+bool serve(const std::string& socketPath, const int workers) {
+    std::cerr << "the render server needs unix domain sockets" << std::endl;
+    return false;
+}
+
+std::string send_request(const std::string& socketPath, const std::string& request) {
+    return "";
+}
+
+#endif
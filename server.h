@@ -0,0 +1,49 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <string>
+#include <vector>
+
+#include "geometry.h"
+
+/**
+ * one render request: the models drawn in order, the camera, the frame size and the output file
+*/
+struct RenderJob
+{
+    std::vector<std::string> models;
+    vec3f eye;
+    vec3f center;
+    vec3f up;
+    int width = 0;
+    int height = 0;
+    std::string output;
+};
+
+/**
+ * parse a request line "render width height eye.x eye.y eye.z center.x center.y center.z up.x up.y up.z output model...",
+ * paths can't contain white space
+ * @return false with error filled when the line is malformed
+*/
+bool parse_job(const std::string& line, RenderJob& job, std::string& error);
+
+/**
+ * Render requests from a unix domain socket until a "quit" request.
+ * Every connection sends one request line and receives one reply line:
+ *   render ...  "ok queue <depth> wait <ms> render <ms>" once the frame is written, or "error <message>"
+ *   stats       "ok jobs <n> failed <n> queued <n> models <n> mean <ms> max <ms>", latencies include the queue wait
+ *   quit        "ok", the queued jobs are finished before the server returns
+ * Requests are read on a thread per connection, a client has 5 s to send its line before it is dropped.
+ * Parsed models and their textures stay resident across requests, jobs run on a pool of workers.
+ * @param workers number of jobs rendered concurrently
+ * @return false when the socket can't be created
+*/
+bool serve(const std::string& socketPath, const int workers);
+
+/**
+ * send one request line to the server at socketPath
+ * @return the reply line, empty when the server can't be reached
+*/
+std::string send_request(const std::string& socketPath, const std::string& request);
+
+#endif
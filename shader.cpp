@@ -0,0 +1,17 @@
+#include "shader.h"
+
+#include "trace.h"
+
+void render_model(RenderContext& ctx, const Model& m, const mat4f& modelMatrix, const vec3f& lightDirection) {
+    TRACE_SCOPE("draw model");
+    IShader shader(ctx, m, modelMatrix, lightDirection);
+    for(int i = 0; i < m.nfaces(); i++) {
+        std::array<vec4f, 3> clipVerts = {};
+        TraceZone vertexZone("vertex");
+        for(int j = 0; j < 3; j++) {
+            clipVerts[j] = shader.vertex(i, j);
+        }
+        vertexZone.end();
+        triangle(ctx, clipVerts, shader);
+    }
+}
@@ -0,0 +1,139 @@
+#ifndef __SHADER_H__
+#define __SHADER_H__
+
+#include <algorithm>
+#include <cmath>
+
+#include "geometry.h"
+#include "model.h"
+#include "ourGL.h"
+#include "lights.h"
+
+const vec3f lightDir(1.0f, 1.0f, 1.0f); // default light direction in world coordinates
+
+/**
+ * x to the power n by repeated squaring, at most 2 * log2(n) multiplies instead of std::pow's log and exp.
+ * Specular exponents are small integers, the double accumulator keeps the result within rounding of std::pow.
+*/
+inline float pow_int(const float x, int n) {
+    double base = x, ret = 1;
+    for(; n > 0; n >>= 1) {
+        if(n & 1) ret *= base;
+        base *= base;
+    }
+    return ret;
+}
+
+class IShader: public Shader {
+    const RenderContext& ctx;
+    const Model& model;
+    mat4f uniform_M; // model to clip coordinates
+    mat4f uniform_MIT; // invert transpose of uniform_M, transforms normals
+    vec3f light; // light direction normalized in camera coordinates
+    mat<float, 2, 3> varying_uv; //  triangle uv coordinates, written by vertex shader, read by fragment shader
+    mat3f varying_nrm; // normal of per vertex of triangle
+    mat3f ndc_tri; // vertex with homogenous coordinates in triangle
+    mat3f varying_pos; // camera coordinates of per vertex of triangle, only written with local lights
+    mat4f uniform_screen; // camera to screen coordinates, picks the light grid cell of a fragment
+    const LightSet* lights; // local lights of the context, nullptr when it has none
+
+    // light reaching camera space position pos with normal n from one local light, rgb
+    vec3f local_light(const Light& l, const vec3f& pos, const vec3f& n, const int exponent) const {
+        vec3f L = l.position - pos;
+        const float d2 = L * L;
+        if(d2 >= l.radius * l.radius) return vec3f(0, 0, 0);
+        L = L / std::sqrt(d2);
+        float falloff = 1 - d2 / (l.radius * l.radius);
+        falloff *= falloff;
+        if(l.type == SPOT_LIGHT) {
+            const float cone = (l.direction * L * -1 - l.cosOuter) / (l.cosInner - l.cosOuter);
+            falloff *= std::max(0.0f, std::min(1.0f, cone));
+        }
+        const float diffuse = std::max(0.0f, n * L);
+        if(diffuse <= 0 || falloff <= 0) return vec3f(0, 0, 0);
+        vec3f r = (n * diffuse * 2 - L).normalize();
+        return l.color * (falloff * (diffuse + pow_int(std::max(r.z, 0.0f), exponent)));
+    }
+
+    // sum of the local lights at pos, only the lights of its grid cell when the set is tiled
+    vec3f local_lights(const vec3f& pos, const vec3f& n, const int exponent) const {
+        vec3f sum(0, 0, 0);
+        if(!lights->tiled) {
+            for(const Light& l: lights->lights) {
+                sum = sum + local_light(l, pos, n, exponent);
+            }
+            return sum;
+        }
+        vec4f p = uniform_screen * embed<float, 4>(pos);
+        const int tx = std::max(0, std::min(lights->width - 1, (int)(p[0] / p[3]) / lights->tile));
+        const int ty = std::max(0, std::min(lights->height - 1, (int)(p[1] / p[3] - ctx.yoffset) / lights->tile));
+        const int cell = lights->cell(tx, ty, lights->slice(p[3]));
+        for(int k = lights->offsets[cell]; k < lights->offsets[cell + 1]; k++) {
+            sum = sum + local_light(lights->lights[lights->indices[k]], pos, n, exponent);
+        }
+        return sum;
+    }
+
+public:    
+    IShader(const RenderContext& c, const Model& m, const mat4f& modelMatrix = mat4f::identity(), const vec3f& lightDirection = lightDir): ctx(c), model(m){
+        uniform_M = ctx.Projection * ctx.ModelView * modelMatrix;
+        uniform_MIT = uniform_M.invert_transpose();
+        light = (proj<float, 3>(ctx.Projection * ctx.ModelView * embed<float, 4>(lightDirection, 0.0f))).normalize(); // tramsform lightDir into camera coordinates
+        uniform_screen = ctx.Viewport * ctx.Projection;
+        lights = ctx.lights && !ctx.lights->lights.empty() ? ctx.lights : nullptr;
+    }
+
+    
+    virtual vec4f vertex(const int iface, const int nthvert) override {
+        varying_uv.set_col(nthvert, model.uv(iface, nthvert));
+        varying_nrm.set_col(nthvert, proj<float, 3>(uniform_MIT * embed<float, 4>(model.normal(iface, nthvert), 0.0f))); // transform normal, reference: https://github.com/ssloy/tinyrenderer/wiki/Lesson-5-Moving-the-camera
+        vec4f glVertex = uniform_M * embed<float, 4>(model.vert(iface, nthvert));
+        ndc_tri.set_col(nthvert, proj<float, 3>(glVertex/glVertex[3]));
+        if(lights) varying_pos.set_col(nthvert, proj<float, 3>(glVertex)); // the projection keeps x, y, z of camera coordinates
+        return glVertex;
+    }
+
+    virtual bool fragment(const vec3f& bar, TGAColor& color) override {
+        vec3f bn = (varying_nrm * bar).normalize();
+        vec2f uv = varying_uv * bar;
+        // use tangent space normal texture, you can read by: https://github.com/ssloy/tinyrenderer/wiki/Lesson-6bis-tangent-space-normal-mapping
+        mat3f AI = mat3f{
+            {
+                ndc_tri.col(1) - ndc_tri.col(0),
+                ndc_tri.col(2) - ndc_tri.col(0),
+                bn
+            }
+        }.invert();
+        vec3f i = AI * vec3f(varying_uv[0][1] - varying_uv[0][0], varying_uv[0][2] - varying_uv[0][0], 0.0f);
+        vec3f j = AI * vec3f(varying_uv[1][1] - varying_uv[1][0], varying_uv[1][2] - varying_uv[1][0], 0.0f);
+        
+        mat3f B = mat3f{ {i.normalize(), j.normalize(), bn} }.transpose();
+        vec3f n = (B * model.normal(uv)).normalize(); // get normal from tangent space
+        vec3f r = (n * (n * light) * 2 - light).normalize(); // Phone shading， https://github.com/ssloy/tinyrenderer/wiki/Lesson-6-Shaders-for-the-software-renderer
+        float specular = pow_int(std::max(r.z, 0.0f), 5 + model.specular(uv));
+        float diffuse = std::max(0.0f, n * light);
+        float ambient = 10;
+        TGAColor c = model.diffuse(uv);
+        color = c;
+        if(lights) {
+            vec3f local = local_lights(varying_pos * bar, n, 5 + model.specular(uv));
+            for(int i = 0; i < 3; i++) {
+                color[i] = std::min<int>((ambient + c[i] * (diffuse + specular + local[2 - i])), 255); // bgr
+            }
+            return false;
+        }
+        for(int i = 0; i < 3; i++) {
+            color[i] = std::min<int>((ambient + c[i] * (diffuse + specular)), 255);
+        }
+        return false;
+    }
+};
+
+/**
+ * vertex shade every face of m and rasterize it into the targets of ctx
+ * @param modelMatrix model to world transform
+ * @param lightDirection light direction in world coordinates
+*/
+void render_model(RenderContext& ctx, const Model& m, const mat4f& modelMatrix = mat4f::identity(), const vec3f& lightDirection = lightDir);
+
+#endif
@@ -0,0 +1,84 @@
+#include "synthetic.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+
+#include "tgaimage.h"
+#include "trace.h"
+
+namespace {
+
+bool write_textures(const std::string& objPath, const int size) {
+    const std::string base = objPath.substr(0, objPath.find_last_of("."));
+    TGAImage diffuse(size, size, TGAImage::RGB);
+    TGAImage normal(size, size, TGAImage::RGB);
+    TGAImage specular(size, size, TGAImage::GRAYSCALE);
+    for(int y = 0; y < size; y++) {
+        for(int x = 0; x < size; x++) {
+            const bool odd = ((x * 16 / size) + (y * 16 / size)) & 1; // 16 x 16 checkerboard
+            diffuse.set(x, y, odd ? TGAColor(200, 120, 60) : TGAColor(90, 140, 200));
+            normal.set(x, y, TGAColor(128, 128, 255)); // flat, the tangent space normal is +z
+            specular.set(x, y, TGAColor((std::uint8_t)(odd ? 20 : 2)));
+        }
+    }
+    return diffuse.write_tga_file(base + "_diffuse.tga") && normal.write_tga_file(base + "_nm_tangent.tga") &&
+        specular.write_tga_file(base + "_spec.tga");
+}
+
+}
+
+bool write_synthetic_model(const std::string& objPath, const SyntheticSpec& spec) {
+    TRACE_SCOPE("write synthetic model");
+    std::ofstream out(objPath, std::ios::binary);
+    if(!out) {
+        std::cerr << "can't write " << objPath << std::endl;
+        return false;
+    }
+    const float smallEdge = 0.004f, largeEdge = 0.2f; // about 1.5 and 75 pixels at 1024 x 1024
+    std::mt19937 rng(spec.seed);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::uniform_int_distribution<int> layer(0, std::max(1, spec.layers) - 1);
+
+    // vertices with their uvs first, then the faces, written through one buffer
+    char line[128];
+    std::string buffer;
+    buffer.reserve(1 << 20);
+    auto emit = [&](const int n) {
+        buffer.append(line, n);
+        if(buffer.size() > (1 << 20) - 128) {
+            out.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    };
+    for(long i = 0; i < spec.faces; i++) {
+        float edge = spec.sizes == SMALL_TRIANGLES ? smallEdge : spec.sizes == LARGE_TRIANGLES ? largeEdge :
+            smallEdge * std::pow(largeEdge / smallEdge, unit(rng));
+        float cx = unit(rng) * 2 - 1, cy = unit(rng) * 2 - 1;
+        float z = spec.layers > 1 ? -0.5f + (float)layer(rng) / (spec.layers - 1) : 0.0f;
+        float angle = unit(rng) * 6.2831853f;
+        for(int j = 0; j < 3; j++) { // counter clockwise seen from +z, so front facing
+            float a = angle + j * 2.0943951f;
+            float x = cx + edge * 0.57735f * std::cos(a), y = cy + edge * 0.57735f * std::sin(a);
+            emit(std::snprintf(line, sizeof(line), "v %.6f %.6f %.6f\n", x, y, z));
+            // uv from the position, so the checkerboard is continuous over the whole soup
+            float u = std::min(0.999f, std::max(0.0f, (x + 1) * 0.5f)), w = std::min(0.999f, std::max(0.0f, (y + 1) * 0.5f));
+            emit(std::snprintf(line, sizeof(line), "vt %.6f %.6f\n", u, w));
+        }
+    }
+    emit(std::snprintf(line, sizeof(line), "vn 0 0 1\n"));
+    for(long i = 0; i < spec.faces; i++) {
+        const long v = i * 3 + 1;
+        emit(std::snprintf(line, sizeof(line), "f %ld/%ld/1 %ld/%ld/1 %ld/%ld/1\n", v, v, v + 1, v + 1, v + 2, v + 2));
+    }
+    out.write(buffer.data(), buffer.size());
+    out.close();
+    if(!out) {
+        std::cerr << "can't write " << objPath << std::endl;
+        return false;
+    }
+    return write_textures(objPath, spec.textureSize);
+}
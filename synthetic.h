@@ -0,0 +1,33 @@
+#ifndef __SYNTHETIC_H__
+#define __SYNTHETIC_H__
+
+#include <string>
+
+/**
+ * distribution of the triangle edge length, measured at the default 1024 x 1024 camera
+*/
+enum TriangleSizes
+{
+    SMALL_TRIANGLES, // about one pixel of area
+    MIXED_TRIANGLES, // log uniform between small and large
+    LARGE_TRIANGLES // about 75 pixels on a side
+};
+
+struct SyntheticSpec
+{
+    long faces = 1000000;
+    TriangleSizes sizes = MIXED_TRIANGLES;
+    int layers = 4; // triangles are spread over this many planes stacked in z, the depth complexity where they overlap
+    unsigned seed = 1;
+    int textureSize = 256; // side of the generated textures
+};
+
+/**
+ * Write a triangle soup in the square [-1, 1] x [-1, 1] facing +z as a triangulated obj file,
+ * plus the <name>_diffuse.tga, <name>_nm_tangent.tga and <name>_spec.tga textures Model loads with it.
+ * Every triangle has its own vertices, so the file has 3 vertices per face.
+ * @return false when a file can't be written
+*/
+bool write_synthetic_model(const std::string& objPath, const SyntheticSpec& spec);
+
+#endif
@@ -0,0 +1,209 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "../tgaimage.h"
+
+/**
+ * checks of TGAImage::scale, convert and the orientation flips that need no reference image,
+ * prints every failure and exits non zero when there is one
+*/
+namespace {
+
+int failures = 0;
+
+void check(const bool ok, const std::string& what) {
+    if(!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+bool same(const TGAImage& a, const TGAImage& b) {
+    if(a.get_width() != b.get_width() || a.get_height() != b.get_height() || a.get_bytespp() != b.get_bytespp()) return false;
+    for(int y = 0; y < a.get_height(); y++) {
+        for(int x = 0; x < a.get_width(); x++) {
+            TGAColor p = a.get(x, y), q = b.get(x, y);
+            for(int c = 0; c < a.get_bytespp(); c++) {
+                if(p[c] != q[c]) return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool constant(const TGAImage& image, const TGAColor& color) {
+    for(int y = 0; y < image.get_height(); y++) {
+        for(int x = 0; x < image.get_width(); x++) {
+            TGAColor p = image.get(x, y);
+            for(int c = 0; c < image.get_bytespp(); c++) {
+                if(p[c] != color[c]) return false;
+            }
+        }
+    }
+    return true;
+}
+
+// every pixel gets a different color so misplaced pixels show up
+TGAImage pattern(const int w, const int h, const int bytespp) {
+    TGAImage image(w, h, bytespp);
+    for(int y = 0; y < h; y++) {
+        for(int x = 0; x < w; x++) {
+            image.set(x, y, bytespp == TGAImage::GRAYSCALE ? TGAColor((std::uint8_t)(x * 7 + y * 13))
+                : TGAColor((std::uint8_t)(x * 3), (std::uint8_t)(y * 5), (std::uint8_t)(x + y), (std::uint8_t)(x ^ y)));
+        }
+    }
+    return image;
+}
+
+void test_scale_constant() {
+    // the large sizes are split over threads on a multi-core machine, the odd ones go through the partial box weights
+    const int sizes[][4] = {{100, 60, 37, 23}, {37, 23, 100, 60}, {64, 64, 64, 64}, {1600, 1200, 533, 401}, {300, 200, 1500, 1000}};
+    for(int bytespp: {TGAImage::GRAYSCALE, TGAImage::RGB, TGAImage::RGBA}) {
+        TGAColor color = bytespp == TGAImage::GRAYSCALE ? TGAColor(201) : TGAColor(255, 17, 128, 3);
+        for(const auto& s: sizes) {
+            TGAImage image(s[0], s[1], bytespp);
+            for(int y = 0; y < s[1]; y++) {
+                for(int x = 0; x < s[0]; x++) {
+                    image.set(x, y, color);
+                }
+            }
+            image.scale(s[2], s[3]);
+            const std::string what = "scale " + std::to_string(s[0]) + "x" + std::to_string(s[1]) + " to " + std::to_string(s[2])
+                + "x" + std::to_string(s[3]) + " at " + std::to_string(bytespp) + " bytes per pixel";
+            check(image.get_width() == s[2] && image.get_height() == s[3], what + " size");
+            check(constant(image, color), what + " keeps a constant image constant");
+        }
+    }
+}
+
+void test_scale_identity() {
+    for(int bytespp: {TGAImage::GRAYSCALE, TGAImage::RGB, TGAImage::RGBA}) {
+        TGAImage image = pattern(700, 500, bytespp);
+        TGAImage scaled = image;
+        scaled.scale(700, 500);
+        check(same(image, scaled), "scale to the same size at " + std::to_string(bytespp) + " bytes per pixel");
+    }
+}
+
+void test_scale_average() {
+    // 2x2 blocks of 0, 100, 50, 250 average to exactly 100
+    TGAImage image(512, 512, TGAImage::GRAYSCALE);
+    const std::uint8_t block[4] = {0, 100, 50, 250};
+    for(int y = 0; y < 512; y++) {
+        for(int x = 0; x < 512; x++) {
+            image.set(x, y, TGAColor(block[(x & 1) + 2 * (y & 1)]));
+        }
+    }
+    image.scale(256, 256);
+    check(constant(image, TGAColor(100)), "scale by one half averages 2x2 blocks");
+}
+
+void test_convert_round_trip() {
+    const int trips[][2] = {{TGAImage::RGB, TGAImage::RGBA}, {TGAImage::GRAYSCALE, TGAImage::RGB}, {TGAImage::GRAYSCALE, TGAImage::RGBA}};
+    for(const auto& t: trips) {
+        for(int w: {31, 1024}) { // 1024x768 is split over threads on a multi-core machine
+            TGAImage image = pattern(w, w * 3 / 4, t[0]);
+            TGAImage converted = image;
+            const std::string what = "convert " + std::to_string(t[0]) + " to " + std::to_string(t[1]) + " and back at width " + std::to_string(w);
+            check(converted.convert(t[1]) && converted.get_bytespp() == t[1], what);
+            if(t[0] == TGAImage::RGB) {
+                check(converted.get(5, 7)[3] == 255, what + " sets an opaque alpha");
+            }
+            check(converted.convert(t[0]) && same(image, converted), what + " is exact");
+        }
+    }
+    TGAImage image = pattern(16, 16, TGAImage::RGB);
+    check(!image.convert(2), "convert rejects 2 bytes per pixel");
+    TGAColor luma = TGAColor(10, 200, 40);
+    image.set(0, 0, luma);
+    image.convert(TGAImage::GRAYSCALE);
+    check(image.get(0, 0)[0] == (40 * 29 + 200 * 150 + 10 * 77) / 256, "convert to gray weights b, g, r");
+}
+
+void test_orientation() {
+    TGAImage image = pattern(37, 23, TGAImage::RGB);
+    TGAImage flipped = image;
+    flipped.flip_vertically();
+    flipped.flip_horizontally();
+    check(flipped.get(0, 0)[0] == image.get(36, 22)[0] && flipped.get(0, 0)[1] == image.get(36, 22)[1], "flips move the corner");
+    TGAImage reordered = flipped;
+    reordered.apply_orientation();
+    check(same(flipped, reordered), "apply_orientation keeps the logical pixels");
+    flipped.flip_horizontally();
+    flipped.flip_vertically();
+    check(same(image, flipped), "flipping twice is the identity");
+    reordered.flip_vertically();
+    reordered.flip_horizontally();
+    reordered.apply_orientation();
+    check(same(image, reordered), "flipping back a reordered image is the identity");
+}
+
+void test_file_round_trip() {
+    for(bool rle: {false, true}) {
+        TGAImage image = pattern(41, 29, TGAImage::RGBA);
+        image.flip_vertically();
+        image.flip_horizontally();
+        const std::string path = std::string("tgaimage_test") + (rle ? "_rle" : "_raw") + ".tga";
+        TGAImage read;
+        check(image.write_tga_file(path, false, rle) && read.read_tga_file(path), "write and read " + path);
+        check(same(image, read), "write and read " + path + " keeps the pixels");
+        std::remove(path.c_str());
+    }
+}
+
+// the file of a horizontally flipped image is left to right without the 0x10 header bit, which many readers ignore
+void test_hflip_file_order() {
+    for(bool vflip: {false, true}) {
+        TGAImage image = pattern(41, 29, TGAImage::RGB);
+        image.flip_horizontally();
+        const std::string path = "tgaimage_test_hflip.tga";
+        check(image.write_tga_file(path, vflip, false), "write " + path);
+        std::ifstream in(path, std::ios::binary);
+        std::vector<char> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        in.close();
+        std::remove(path.c_str());
+        const std::size_t pixelBytes = 41 * 29 * 3;
+        if(file.size() < sizeof(TGA_Header) + pixelBytes) {
+            check(false, "hflipped file size");
+            continue;
+        }
+        TGA_Header header;
+        std::memcpy(&header, file.data(), sizeof(header));
+        check(!(header.imagedescriptor & 0x10), "hflipped file has no right-to-left bit");
+        check(!(header.imagedescriptor & 0x20) == vflip, "hflipped file keeps the vertical origin");
+        bool ordered = true;
+        for(int y = 0; y < 29; y++) {
+            for(int x = 0; x < 41; x++) { // rows go out in image order, vflip only picks the origin
+                const char* p = file.data() + sizeof(header) + (y * 41 + x) * 3;
+                TGAColor c = image.get(x, y);
+                for(int k = 0; k < 3; k++) {
+                    ordered = ordered && (std::uint8_t)p[k] == c[k];
+                }
+            }
+        }
+        check(ordered, std::string("hflipped file stores the pixels left to right, vflip ") + (vflip ? "on" : "off"));
+    }
+}
+
+}
+
+int main() {
+    test_scale_constant();
+    test_scale_identity();
+    test_scale_average();
+    test_convert_round_trip();
+    test_orientation();
+    test_file_round_trip();
+    test_hflip_file_order();
+    if(failures) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cerr << "all checks passed" << std::endl;
+    return 0;
+}
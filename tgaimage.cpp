@@ -1,101 +1,173 @@
 #include "tgaimage.h"
+#include "trace.h"
 #include<iostream>
 #include<cstring>
+#include<utility>
+#include<algorithm>
+#include<cstddef>
+#include<thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<unistd.h>
+#define TGAIMAGE_MMAP 1
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include<emmintrin.h>
+#define TGAIMAGE_SSE2 1
+#endif
+
+namespace {
+
+const std::uint8_t developer_area_ref[4] = {0, 0, 0, 0};
+const std::uint8_t extension_area_ref[4] = {0, 0, 0, 0};
+const std::uint8_t footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
+
+TGA_Header make_header(const int width, const int height, const int bytespp, const bool vflip, const bool rle) {
+    TGA_Header header;
+    header.bitsperpixel = bytespp<<3;
+    header.width  = width;
+    header.height = height;
+    header.datatypecode = (bytespp==TGAImage::GRAYSCALE?(rle?11:3):(rle?10:2));
+    header.imagedescriptor = vflip ? 0x00 : 0x20; // top-left or bottom-left origin, always left to right: many readers ignore 0x10
+    return header;
+}
+
+}
 
 TGAImage::TGAImage()
-    :width(0), height(0),data(), bytespp(0){}
+    :width(0), height(0),data(), bytespp(0), mapping(nullptr), mapping_size(0), vflipped(false), hflipped(false) {}
 
 TGAImage::TGAImage(int width, int height, int bytespp)
-    :data(width * height *bytespp, 0), width(width), height(height), bytespp(bytespp) {}
+    :data(width * height *bytespp, 0), width(width), height(height), bytespp(bytespp), mapping(nullptr), mapping_size(0),
+    vflipped(false), hflipped(false) {}
 
+TGAImage::TGAImage(const TGAImage& img)
+    :data(), width(img.width), height(img.height), bytespp(img.bytespp), mapping(nullptr), mapping_size(0),
+    vflipped(img.vflipped), hflipped(img.hflipped) {
+    if(img.has_pixels()) data.assign(img.pixels(), img.pixels() + (std::size_t)width * height * bytespp);
+}
+
+TGAImage::TGAImage(TGAImage&& img)
+    :data(std::move(img.data)), width(img.width), height(img.height), bytespp(img.bytespp),
+    mapping(img.mapping), mapping_size(img.mapping_size), vflipped(img.vflipped), hflipped(img.hflipped) {
+    img.mapping = nullptr;
+    img.mapping_size = 0;
+}
+
+TGAImage& TGAImage::operator=(TGAImage img) {
+    unmap_tga_file();
+    data.swap(img.data);
+    std::swap(width, img.width);
+    std::swap(height, img.height);
+    std::swap(bytespp, img.bytespp);
+    std::swap(mapping, img.mapping);
+    std::swap(mapping_size, img.mapping_size);
+    std::swap(vflipped, img.vflipped);
+    std::swap(hflipped, img.hflipped);
+    return *this;
+}
 
 TGAImage::~TGAImage() {
-    // TODO
+    unmap_tga_file();
+}
+
+bool TGAImage::map_tga_file(const std::string filepath, const int width, const int height, const int bytespp, const bool vflip) {
+    *this = TGAImage();
+#ifdef TGAIMAGE_MMAP
+    std::size_t nbytes = (std::size_t)width * height * bytespp;
+    std::size_t size = sizeof(TGA_Header) + nbytes + sizeof(developer_area_ref) + sizeof(extension_area_ref) + sizeof(footer);
+    int fd = open(filepath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        std::cerr << "can't open file " << filepath << "\n";
+        return false;
+    }
+    if(ftruncate(fd, size) != 0) {
+        close(fd);
+        std::cerr << "can't resize file " << filepath << "\n";
+        return false;
+    }
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if(p == MAP_FAILED) {
+        std::cerr << "can't map file " << filepath << "\n";
+        return false;
+    }
+    mapping = static_cast<std::uint8_t*>(p);
+    mapping_size = size;
+    this->width = width;
+    this->height = height;
+    this->bytespp = bytespp;
+    // the pixels are zero from ftruncate, only header and footer need to be written
+    TGA_Header header = make_header(width, height, bytespp, vflip, false);
+    memcpy(mapping, &header, sizeof(header));
+    std::uint8_t* tail = mapping + sizeof(TGA_Header) + nbytes;
+    memcpy(tail, developer_area_ref, sizeof(developer_area_ref));
+    memcpy(tail + sizeof(developer_area_ref), extension_area_ref, sizeof(extension_area_ref));
+    memcpy(tail + sizeof(developer_area_ref) + sizeof(extension_area_ref), footer, sizeof(footer));
+    return true;
+#else
+    std::cerr << "mapped tga files are not supported on this platform\n";
+    return false;
+#endif
+}
+
+bool TGAImage::unmap_tga_file() {
+    if(!mapping) return true;
+    bool ok = true;
+#ifdef TGAIMAGE_MMAP
+    TRACE_SCOPE("unmap_tga_file");
+    ok = msync(mapping, mapping_size, MS_SYNC) == 0;
+    ok = munmap(mapping, mapping_size) == 0 && ok;
+    if(!ok) std::cerr << "can't flush the mapped tga file\n";
+#endif
+    mapping = nullptr;
+    mapping_size = 0;
+    width = height = bytespp = 0;
+    return ok;
 }
 
 bool TGAImage::load_rle_data(std::ifstream& in) {
-    size_t pixelcount = width*height;
-    size_t currentpixel = 0;
-    size_t currentbyte  = 0;
-    TGAColor colorbuffer;
-    do {
-        std::uint8_t chunkheader = 0;
-        chunkheader = in.get();
-        if (!in.good()) {
+    // decode from memory: the rest of the file in one read instead of a stream call per pixel
+    const std::streampos start = in.tellg();
+    in.seekg(0, std::ios::end);
+    std::vector<std::uint8_t> packed(std::max<std::streamoff>(0, in.tellg() - start));
+    in.seekg(start);
+    in.read(reinterpret_cast<char*>(packed.data()), packed.size());
+    const std::uint8_t* p = packed.data();
+    const std::uint8_t* end = p + packed.size();
+    std::uint8_t* out = data.data();
+    std::uint8_t* outEnd = out + data.size();
+    while(out < outEnd) {
+        if(p >= end) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
-        if (chunkheader<128) {
-            chunkheader++;
-            for (int i=0; i<chunkheader; i++) {
-                in.read(reinterpret_cast<char *>(colorbuffer.bgra), bytespp);
-                if (!in.good()) {
-                    std::cerr << "an error occured while reading the header\n";
-                    return false;
-                }
-                for (int t=0; t<bytespp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
+        std::uint8_t chunkheader = *p++;
+        const std::size_t count = chunkheader < 128 ? chunkheader + 1 : chunkheader - 127;
+        if(out + count * bytespp > outEnd) {
+            std::cerr << "Too many pixels read\n";
+            return false;
+        }
+        if(chunkheader < 128) { // raw packet
+            if(end - p < (std::ptrdiff_t)(count * bytespp)) {
+                std::cerr << "an error occured while reading the header\n";
+                return false;
             }
-        } else {
-            chunkheader -= 127;
-            in.read(reinterpret_cast<char *>(colorbuffer.bgra), bytespp);
-            if (!in.good()) {
+            std::memcpy(out, p, count * bytespp);
+            p += count * bytespp;
+            out += count * bytespp;
+        } else { // run length packet
+            if(end - p < bytespp) {
                 std::cerr << "an error occured while reading the header\n";
                 return false;
             }
-            for (int i=0; i<chunkheader; i++) {
-                for (int t=0; t<bytespp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
+            for(std::size_t i = 0; i < count; i++, out += bytespp) {
+                std::memcpy(out, p, bytespp);
             }
-        }
-    } while (currentpixel < pixelcount);
-    return true;
-}
-
-bool TGAImage::unload_rle_data(std::ofstream& out) const{
-        const std::uint8_t max_chunk_length = 128;
-    size_t npixels = width*height;
-    size_t curpix = 0;
-    while (curpix<npixels) {
-        size_t chunkstart = curpix*bytespp;
-        size_t curbyte = curpix*bytespp;
-        std::uint8_t run_length = 1;
-        bool raw = true;
-        while (curpix+run_length<npixels && run_length<max_chunk_length) {
-            bool succ_eq = true;
-            for (int t=0; succ_eq && t<bytespp; t++)
-                succ_eq = (data[curbyte+t]==data[curbyte+t+bytespp]);
-            curbyte += bytespp;
-            if (1==run_length)
-                raw = !succ_eq;
-            if (raw && succ_eq) {
-                run_length--;
-                break;
-            }
-            if (!raw && !succ_eq)
-                break;
-            run_length++;
-        }
-        curpix += run_length;
-        out.put(raw?run_length-1:run_length+127);
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
-        }
-        out.write(reinterpret_cast<const char *>(data.data()+chunkstart), (raw?run_length*bytespp:bytespp));
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
+            p += bytespp;
         }
     }
     return true;
@@ -116,6 +188,7 @@ bool TGAImage::read_tga_file(const std::string filepath) {
         std::cerr << "can't read header from: " << filepath << std::endl;
         return false;
     }
+    *this = TGAImage();
     this->width = header.width;
     this->height = header.height;
     this->bytespp = header.bitsperpixel>>3;
@@ -145,12 +218,9 @@ bool TGAImage::read_tga_file(const std::string filepath) {
         std::cerr << "unknow file format" << std::endl;
         return false;
     }
-    if(!(header.imagedescriptor & 0x20)) {
-        flip_vertically();
-    }
-    if((header.imagedescriptor & 0x10)) {
-        flip_horizontally();
-    }
+    // keep the file's row and column order, the orientation maps it
+    vflipped = !(header.imagedescriptor & 0x20);
+    hflipped = header.imagedescriptor & 0x10;
     in.close();
     std::cout << "read file successfully, width: " << this->width << "height: " << this->height <<
         "bytespp: " << this->bytespp << std::endl;
@@ -158,143 +228,372 @@ bool TGAImage::read_tga_file(const std::string filepath) {
 }
 
 bool TGAImage::write_tga_file(const std::string filepath, const bool vflip, const bool rle) const {
-    std::uint8_t developer_area_ref[4] = {0, 0, 0, 0};
-    std::uint8_t extension_area_ref[4] = {0, 0, 0, 0};
-    std::uint8_t footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
-    std::ofstream out;
-    out.open (filepath, std::ios::binary);
-    if (!out.is_open()) {
-        std::cerr << "can't open file " << filepath << "\n";
-        out.close();
+    TRACE_SCOPE("write_tga_file");
+    TGAStreamWriter writer(filepath, width, height, bytespp, vflip != vflipped, rle, hflipped);
+    if (!writer.good()) {
         return false;
     }
-    TGA_Header header;
-    header.bitsperpixel = bytespp<<3;
-    header.width  = width;
-    header.height = height;
-    header.datatypecode = (bytespp==GRAYSCALE?(rle?11:3):(rle?10:2));
-    header.imagedescriptor = vflip ? 0x00 : 0x20; // top-left or bottom-left origin
-    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
-    if (!out.good()) {
-        out.close();
-        std::cerr << "can't dump the tga file\n";
-        return false;
+    return writer.write_rows(pixels(), height) && writer.finish();
+}
+
+namespace {
+
+// reverse the order of the n pixels of one row in place
+template<int N> void reverse_pixels(std::uint8_t* row, const int n) {
+    std::uint8_t* l = row;
+    std::uint8_t* r = row + (n - 1) * N;
+#ifdef TGAIMAGE_SSE2
+    if(N == 4) {
+        // four pixels from each end per step, reversed within the register
+        for(; r - l >= 28; l += 16, r -= 16) {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(l));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r - 12));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(l), _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 1, 2, 3)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(r - 12), _mm_shuffle_epi32(a, _MM_SHUFFLE(0, 1, 2, 3)));
+        }
     }
-    if (!rle) {
-        out.write(reinterpret_cast<const char *>(data.data()), width*height*bytespp);
-        if (!out.good()) {
-            std::cerr << "can't unload raw data\n";
-            out.close();
-            return false;
+#endif
+    for(; l < r; l += N, r -= N) {
+        std::uint8_t t[N];
+        std::memcpy(t, l, N);
+        std::memcpy(l, r, N);
+        std::memcpy(r, t, N);
+    }
+}
+
+// destination sample i of a box filter from n to m samples covers the source range [i * n / m, (i + 1) * n / m),
+// first[i] is its first source sample and weights holds one weight per covered source sample, summing to 1
+void box_weights(const int n, const int m, std::vector<int>& first, std::vector<int>& count, std::vector<float>& weights) {
+    const double ratio = (double)n / m;
+    first.resize(m);
+    count.resize(m);
+    weights.clear();
+    for(int i = 0; i < m; i++) {
+        if(ratio <= 1) { // magnifying: the box is inside one source sample
+            first[i] = std::min(n - 1, (int)((i + 0.5) * ratio));
+            count[i] = 1;
+            weights.push_back(1.0f);
+            continue;
         }
-    } else {
-        if (!unload_rle_data(out)) {
-            out.close();
-            std::cerr << "can't unload rle data\n";
-            return false;
+        const double a = i * ratio, b = std::min((double)n, (i + 1) * ratio);
+        first[i] = (int)a;
+        count[i] = 0;
+        for(int k = first[i]; k < b; k++) {
+            weights.push_back((std::min(b, k + 1.0) - std::max(a, (double)k)) / ratio);
+            count[i]++;
         }
     }
-    out.write(reinterpret_cast<const char *>(developer_area_ref), sizeof(developer_area_ref));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
-        return false;
+}
+
+/**
+ * run f(y0, y1) over the rows [0, rows) cut into one range per hardware thread, the caller's thread
+ * takes the first one; small images, under about 256 KB per thread, stay on the caller's thread
+*/
+template<class F> void parallel_rows(const int rows, const std::size_t rowBytes, F f) {
+    const std::size_t minBytes = 1 << 18;
+    std::size_t n = std::max(1u, std::thread::hardware_concurrency());
+    n = std::min(n, std::max<std::size_t>(1, rows * rowBytes / minBytes));
+    n = std::min(n, (std::size_t)std::max(1, rows));
+    const int chunk = (rows + n - 1) / n;
+    std::vector<std::thread> pool;
+    for(int y = chunk; y < rows; y += chunk) {
+        pool.emplace_back(f, y, std::min(rows, y + chunk));
     }
-    out.write(reinterpret_cast<const char *>(extension_area_ref), sizeof(extension_area_ref));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
-        return false;
+    f(0, std::min(rows, chunk));
+    for(auto& t: pool) {
+        t.join();
     }
-    out.write(reinterpret_cast<const char *>(footer), sizeof(footer));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
-        return false;
+}
+
+// box filter one source row into m float pixels with the weights of box_weights
+template<int N> void filter_row(const std::uint8_t* src, float* dst, const int m, const int* first, const int* count, const float* weights) {
+    for(int i = 0; i < m; i++, dst += N) {
+        float sum[N] = {};
+        const std::uint8_t* s = src + first[i] * N;
+        for(int k = 0; k < count[i]; k++, s += N, weights++) {
+            for(int c = 0; c < N; c++) {
+                sum[c] += *weights * s[c];
+            }
+        }
+        for(int c = 0; c < N; c++) {
+            dst[c] = sum[c];
+        }
     }
-    out.close();
-    return true;
 }
 
-void TGAImage::flip_horizontally() {
-    if(!data.size()) return;
-    int half = width >> 1;
-    for(int i=0; i < half; i++) {
-        for(int j = 0; j < height; j++) {
-            TGAColor c1 = get(i, j);
-            TGAColor c2 = get(width - i - 1, j);
-            set(i, j, c2);
-            set(width - i - 1, j, c1);
+// line[i] += weight * src[i]
+void accumulate(float* line, const float* src, const float weight, const std::size_t n) {
+    std::size_t i = 0;
+#ifdef TGAIMAGE_SSE2
+    const __m128 w = _mm_set1_ps(weight);
+    for(; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(line + i, _mm_add_ps(_mm_loadu_ps(line + i), _mm_mul_ps(w, _mm_loadu_ps(src + i))));
+    }
+#endif
+    for(; i < n; i++) {
+        line[i] += weight * src[i];
+    }
+}
+
+// dst[i] = line[i] truncated and clamped to 255, the values are not negative
+void store_bytes(std::uint8_t* dst, const float* line, const std::size_t n) {
+    std::size_t i = 0;
+#ifdef TGAIMAGE_SSE2
+    for(; i + 16 <= n; i += 16) {
+        __m128i a = _mm_packs_epi32(_mm_cvttps_epi32(_mm_loadu_ps(line + i)), _mm_cvttps_epi32(_mm_loadu_ps(line + i + 4)));
+        __m128i b = _mm_packs_epi32(_mm_cvttps_epi32(_mm_loadu_ps(line + i + 8)), _mm_cvttps_epi32(_mm_loadu_ps(line + i + 12)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(a, b)); // saturates like the min below
+    }
+#endif
+    for(; i < n; i++) {
+        dst[i] = (std::uint8_t)std::min(255.0f, line[i]);
+    }
+}
+
+template<int From, int To> void convert_pixels(const std::uint8_t* src, std::uint8_t* dst, const std::size_t n) {
+    for(std::size_t i = 0; i < n; i++, src += From, dst += To) {
+        if(From == TGAImage::GRAYSCALE) {
+            dst[0] = src[0];
+            if(To > 1) dst[1] = dst[2] = src[0];
+        } else if(To == TGAImage::GRAYSCALE) {
+            dst[0] = (src[0] * 29 + src[1] * 150 + src[2] * 77) >> 8; // bgr luma
+        } else {
+            dst[0] = src[0];
+            dst[1] = src[1];
+            dst[2] = src[2];
         }
+        if(To == TGAImage::RGBA) dst[3] = From == TGAImage::RGBA ? src[3] : 255;
     }
 }
 
+}
+
+void TGAImage::flip_horizontally() {
+    hflipped = !hflipped;
+    if(mapping) apply_orientation(); // the header of a mapped file is already written
+}
+
 void TGAImage::flip_vertically() {
-    if(!data.size()) return;
-    std::size_t byte_per_line = width * bytespp;
-    std::vector<std::uint8_t> line(byte_per_line, 0);
-    int half = height >> 1;
-    for(int j=0; j < half; j++) {
-        std::size_t l1 = j * byte_per_line;
-        std::size_t l2 = (height - j - 1) * byte_per_line;
-        std::copy(data.begin() + l1, data.begin() + l1 + byte_per_line, line.begin());
-        std::copy(data.begin() + l2, data.begin() + l2 + byte_per_line, data.begin() + l1);
-        std::copy(line.begin(), line.end(), data.begin() + l2);
+    vflipped = !vflipped;
+    if(mapping) apply_orientation();
+}
+
+void TGAImage::apply_orientation() {
+    if(!has_pixels() || !(vflipped || hflipped)) return;
+    TRACE_SCOPE("apply_orientation");
+    const std::size_t rowBytes = (std::size_t)width * bytespp;
+    std::uint8_t* p = pixels();
+    if(vflipped) {
+        for(int j = 0; j < height / 2; j++) {
+            std::swap_ranges(p + j * rowBytes, p + (j + 1) * rowBytes, p + (height - 1 - j) * rowBytes);
+        }
+    }
+    if(hflipped) {
+        for(int j = 0; j < height; j++) {
+            std::uint8_t* row = p + j * rowBytes;
+            switch(bytespp) {
+            case GRAYSCALE: reverse_pixels<1>(row, width); break;
+            case RGB: reverse_pixels<3>(row, width); break;
+            default: reverse_pixels<4>(row, width); break;
+            }
+        }
     }
+    vflipped = hflipped = false;
 }
 
 void TGAImage::scale(const int w, const int h) {
-    if (w<=0 || h<=0 || !data.size()) return;
-    std::vector<std::uint8_t> tdata(w*h*bytespp, 0);
-    int nscanline = 0;
-    int oscanline = 0;
-    int erry = 0;
-    size_t nlinebytes = w*bytespp;
-    size_t olinebytes = width*bytespp;
-    for (int j=0; j<height; j++) {
-        int errx = width-w;
-        int nx   = -bytespp;
-        int ox   = -bytespp;
-        for (int i=0; i<width; i++) {
-            ox += bytespp;
-            errx += w;
-            while (errx>=(int)width) {
-                errx -= width;
-                nx += bytespp;
-                memcpy(tdata.data()+nscanline+nx, data.data()+oscanline+ox, bytespp);
+    if (w<=0 || h<=0 || data.empty()) return;
+    TRACE_SCOPE("scale");
+    // separable box filter, rows first into a float buffer, then columns, both passes split over threads by rows
+    std::vector<int> xfirst, xcount, yfirst, ycount;
+    std::vector<float> xweights, yweights;
+    box_weights(width, w, xfirst, xcount, xweights);
+    box_weights(height, h, yfirst, ycount, yweights);
+    const std::size_t lineFloats = (std::size_t)w * bytespp;
+    std::vector<float> rows((std::size_t)height * lineFloats);
+    parallel_rows(height, (std::size_t)width * bytespp, [&](const int y0, const int y1) {
+        for(int y = y0; y < y1; y++) {
+            const std::uint8_t* src = data.data() + (std::size_t)y * width * bytespp;
+            float* dst = rows.data() + (std::size_t)y * lineFloats;
+            switch(bytespp) {
+            case GRAYSCALE: filter_row<GRAYSCALE>(src, dst, w, xfirst.data(), xcount.data(), xweights.data()); break;
+            case RGB: filter_row<RGB>(src, dst, w, xfirst.data(), xcount.data(), xweights.data()); break;
+            case RGBA: filter_row<RGBA>(src, dst, w, xfirst.data(), xcount.data(), xweights.data()); break;
             }
         }
-        erry += h;
-        oscanline += olinebytes;
-        while (erry>=(int)height) {
-            if (erry>=(int)height<<1) // it means we jump over a scanline
-                memcpy(tdata.data()+nscanline+nlinebytes, tdata.data()+nscanline, nlinebytes);
-            erry -= height;
-            nscanline += nlinebytes;
-        }
+    });
+    std::vector<std::size_t> ystart(h + 1, 0); // first weight of every destination row
+    for(int j = 0; j < h; j++) {
+        ystart[j + 1] = ystart[j] + ycount[j];
     }
-    data = tdata;
+    std::vector<std::uint8_t> tdata((std::size_t)w * h * bytespp);
+    parallel_rows(h, lineFloats * sizeof(float), [&](const int j0, const int j1) {
+        std::vector<float> line(lineFloats);
+        for(int j = j0; j < j1; j++) {
+            std::fill(line.begin(), line.end(), 0.5f); // rounds on truncation
+            for(int k = 0; k < ycount[j]; k++) {
+                accumulate(line.data(), rows.data() + (yfirst[j] + k) * lineFloats, yweights[ystart[j] + k], lineFloats);
+            }
+            store_bytes(tdata.data() + j * lineFloats, line.data(), lineFloats);
+        }
+    });
+    data.swap(tdata);
     width = w;
     height = h;
 }
 
+bool TGAImage::convert(const int to) {
+    if((to != GRAYSCALE && to != RGB && to != RGBA) || mapping) return false;
+    if(to == bytespp) return true;
+    TRACE_SCOPE("convert");
+    std::vector<std::uint8_t> tdata(data.empty() ? 0 : (std::size_t)width * height * to);
+    if(!data.empty()) {
+        const int from = bytespp;
+        parallel_rows(height, (std::size_t)width * std::max(from, to), [&](const int y0, const int y1) {
+            const std::uint8_t* src = data.data() + (std::size_t)y0 * width * from;
+            std::uint8_t* dst = tdata.data() + (std::size_t)y0 * width * to;
+            const std::size_t n = (std::size_t)(y1 - y0) * width;
+            switch(from * 8 + to) {
+            case GRAYSCALE * 8 + RGB: convert_pixels<GRAYSCALE, RGB>(src, dst, n); break;
+            case GRAYSCALE * 8 + RGBA: convert_pixels<GRAYSCALE, RGBA>(src, dst, n); break;
+            case RGB * 8 + GRAYSCALE: convert_pixels<RGB, GRAYSCALE>(src, dst, n); break;
+            case RGB * 8 + RGBA: convert_pixels<RGB, RGBA>(src, dst, n); break;
+            case RGBA * 8 + GRAYSCALE: convert_pixels<RGBA, GRAYSCALE>(src, dst, n); break;
+            case RGBA * 8 + RGB: convert_pixels<RGBA, RGB>(src, dst, n); break;
+            }
+        });
+    }
+    data.swap(tdata);
+    bytespp = to;
+    return true;
+}
+
 TGAColor TGAImage::get(const int x, const int y) const {
-    if(data.empty() || x < 0 || y < 0 || x >= width || y >= height) {
+    if(!has_pixels() || x < 0 || y < 0 || x >= width || y >= height) {
         return {};
     } else {
-        return TGAColor(data.data() + (x + y * width) * bytespp, bytespp);
+        return TGAColor(pixels() + ((hflipped ? width - 1 - x : x) + (vflipped ? height - 1 - y : y) * width) * bytespp, bytespp);
     }
 }
 
 void TGAImage::set(const int x, const int y, const TGAColor& color) {
-    if(data.empty() || x < 0 || y < 0 || x >= width || y >= height) {
+    if(!has_pixels() || x < 0 || y < 0 || x >= width || y >= height) {
         return;
     } else {
-        memcpy(data.data() + (x + y * width) * bytespp, color.bgra, bytespp);
+        memcpy(pixels() + ((hflipped ? width - 1 - x : x) + (vflipped ? height - 1 - y : y) * width) * bytespp, color.bgra, bytespp);
     }
 }
 
 void TGAImage::clear() {
-    data = std::vector<std::uint8_t>(width * height * bytespp, 0);
+    if(mapping) {
+        memset(pixels(), 0, (std::size_t)width * height * bytespp);
+    } else {
+        data = std::vector<std::uint8_t>(width * height * bytespp, 0);
+    }
+}
+
+
+
+TGAStreamWriter::TGAStreamWriter(const std::string filepath, const int width, const int height, const int bytespp,
+    const bool vflip, const bool rle, const bool hflip)
+    :out(), width(width), height(height), bytespp(bytespp), rle(rle), hflip(hflip), rows_written(0), pending(), reversed() {
+    out.open(filepath, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << filepath << "\n";
+        return;
+    }
+    TGA_Header header = make_header(width, height, bytespp, vflip, rle);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    if (!out.good()) {
+        fail("can't dump the tga file\n");
+    }
+}
+
+TGAStreamWriter::~TGAStreamWriter() {
+    out.close();
+}
+
+bool TGAStreamWriter::fail(const char* msg) {
+    std::cerr << msg;
+    out.close();
+    return false;
+}
+
+bool TGAStreamWriter::write_rows(const std::uint8_t* rows, const int nrows) {
+    if (!good()) return false;
+    if (rows_written + nrows > height) return fail("too many rows for the tga file\n");
+    std::size_t nbytes = (std::size_t)width * nrows * bytespp;
+    rows_written += nrows;
+    if (hflip) {
+        // stored right to left, the file gets them left to right
+        reversed.assign(rows, rows + nbytes);
+        for (int j = 0; j < nrows; j++) {
+            std::uint8_t* row = reversed.data() + (std::size_t)j * width * bytespp;
+            switch(bytespp) {
+            case TGAImage::GRAYSCALE: reverse_pixels<1>(row, width); break;
+            case TGAImage::RGB: reverse_pixels<3>(row, width); break;
+            default: reverse_pixels<4>(row, width); break;
+            }
+        }
+        rows = reversed.data();
+    }
+    if (!rle) {
+        out.write(reinterpret_cast<const char *>(rows), nbytes);
+        if (!out.good()) return fail("can't unload raw data\n");
+        return true;
+    }
+    pending.insert(pending.end(), rows, rows + nbytes);
+    return flush_rle(rows_written == height);
 }
 
+/**
+ * pack pending pixels into rle chunks. A chunk is only emitted once the 128 pixels
+ * following its start are known (or the image is complete), so chunk boundaries do
+ * not depend on how the rows were split into write_rows calls.
+*/
+bool TGAStreamWriter::flush_rle(const bool last) {
+    const std::uint8_t max_chunk_length = 128;
+    size_t npixels = pending.size() / bytespp;
+    size_t curpix = 0;
+    while (curpix<npixels && (last || curpix+max_chunk_length<npixels)) {
+        size_t chunkstart = curpix*bytespp;
+        size_t curbyte = curpix*bytespp;
+        std::uint8_t run_length = 1;
+        bool raw = true;
+        while (curpix+run_length<npixels && run_length<max_chunk_length) {
+            bool succ_eq = true;
+            for (int t=0; succ_eq && t<bytespp; t++)
+                succ_eq = (pending[curbyte+t]==pending[curbyte+t+bytespp]);
+            curbyte += bytespp;
+            if (1==run_length)
+                raw = !succ_eq;
+            if (raw && succ_eq) {
+                run_length--;
+                break;
+            }
+            if (!raw && !succ_eq)
+                break;
+            run_length++;
+        }
+        curpix += run_length;
+        out.put(raw?run_length-1:run_length+127);
+        if (!out.good()) return fail("can't dump the tga file\n");
+        out.write(reinterpret_cast<const char *>(pending.data()+chunkstart), (raw?run_length*bytespp:bytespp));
+        if (!out.good()) return fail("can't dump the tga file\n");
+    }
+    pending.erase(pending.begin(), pending.begin() + curpix*bytespp);
+    return true;
+}
+
+bool TGAStreamWriter::finish() {
+    if (!good()) return false;
+    if (rows_written != height) return fail("tga file is missing rows\n");
+    out.write(reinterpret_cast<const char *>(developer_area_ref), sizeof(developer_area_ref));
+    if (!out.good()) return fail("can't dump the tga file\n");
+    out.write(reinterpret_cast<const char *>(extension_area_ref), sizeof(extension_area_ref));
+    if (!out.good()) return fail("can't dump the tga file\n");
+    out.write(reinterpret_cast<const char *>(footer), sizeof(footer));
+    if (!out.good()) return fail("can't dump the tga file\n");
+    out.close();
+    return true;
+}
\ No newline at end of file
@@ -78,8 +78,16 @@ protected:
     int width;
     int height;
     int bytespp;
+    std::uint8_t* mapping; // whole mapped output file when the pixels live in a mmap'ed tga file, otherwise nullptr
+    std::size_t mapping_size;
+    // orientation of the stored pixels: get/set and the writer map logical coordinates through it,
+    // so flipping an image only toggles a flag
+    bool vflipped; // logical row y is stored in row height - 1 - y
+    bool hflipped; // logical column x is stored in column width - 1 - x
     bool load_rle_data(std::ifstream& in);
-    bool unload_rle_data(std::ofstream& out) const;
+    std::uint8_t* pixels() { return mapping ? mapping + sizeof(TGA_Header) : data.data(); }
+    const std::uint8_t* pixels() const { return mapping ? mapping + sizeof(TGA_Header) : data.data(); }
+    bool has_pixels() const { return mapping || !data.empty(); }
 
 public:
     enum Format {
@@ -87,18 +95,61 @@ public:
     };
     TGAImage();
     TGAImage(int width, int height, int bytespp);
+    TGAImage(const TGAImage& img); // a copy of a mapped image owns its pixels
+    TGAImage(TGAImage&& img);
+    TGAImage& operator=(TGAImage img);
     ~TGAImage();
     bool read_tga_file(const std::string filepath);
     bool write_tga_file(const std::string filepath, const bool vflip = true, const bool rle = true) const;
-    void flip_horizontally(); // 水平翻转
-    void flip_vertically(); // 竖直翻转
-    void scale(const int w, const int h); // 缩放
+    /**
+     * 直接在输出文件上渲染: create an uncompressed tga file of its final size, mmap it and use the
+     * mapped pixel region as this image's storage, header and footer are written in place.
+     * Whatever is drawn afterwards lands in the file, unmap_tga_file() completes it.
+    */
+    bool map_tga_file(const std::string filepath, const int width, const int height, const int bytespp, const bool vflip = true);
+    bool unmap_tga_file(); // flush the mapped file to disk and release it, the image is empty afterwards
+    bool is_mapped() const { return mapping != nullptr; }
+    void flip_horizontally(); // 水平翻转, O(1): toggles the orientation
+    void flip_vertically(); // 竖直翻转, O(1): toggles the orientation
+    void apply_orientation(); // reorder the stored pixels so row 0 / column 0 are the logical ones, not for mapped images
+    void scale(const int w, const int h); // 缩放 with a box filter split over threads by rows, not for mapped images
+    bool convert(const int bytespp); // change the format between GRAYSCALE, RGB and RGBA, split over threads by rows, not for mapped images
     TGAColor get(const int x, const int y) const; // 获取图片在 x,y坐标处的颜色值
     void set(const int x, const int y, const TGAColor& color); // 设置图片在x,y坐标处的颜色值
     inline int get_width() const { return width; }
     inline int get_height() const { return height; }
     inline int get_bytespp() const { return bytespp; }
-    inline std::uint8_t* buffer() { return data.data(); }
+    inline std::uint8_t* buffer() { return pixels(); } // stored pixels, see apply_orientation()
     void clear();
 };
+
+
+/**
+ * 按行流式写入TGA文件, 不需要整幅图片常驻内存
+ * rows are appended in image memory order (row 0 first), the file is identical
+ * to what TGAImage::write_tga_file produces for the same pixels.
+ * With hflip the rows are stored right to left and are reversed on the way out,
+ * the file is always left to right.
+*/
+class TGAStreamWriter {
+    std::ofstream out;
+    int width;
+    int height;
+    int bytespp;
+    bool rle;
+    bool hflip;
+    int rows_written;
+    std::vector<std::uint8_t> pending; // rle: pixels not yet packed into a chunk
+    std::vector<std::uint8_t> reversed; // hflip: the rows being written, reordered left to right
+    bool flush_rle(const bool last);
+    bool fail(const char* msg);
+
+public:
+    TGAStreamWriter(const std::string filepath, const int width, const int height, const int bytespp,
+        const bool vflip = true, const bool rle = true, const bool hflip = false);
+    ~TGAStreamWriter();
+    bool good() const { return out.is_open() && out.good(); }
+    bool write_rows(const std::uint8_t* rows, const int nrows); // append nrows full scanlines
+    bool finish(); // write the footer once all rows are in
+};
 #endif
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include "trace.h"
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+std::atomic<int> trace_level(TRACE_OFF);
+
+namespace {
+
+struct TraceEvent
+{
+    const char* name;
+    std::uint64_t begin;
+    std::uint64_t end;
+};
+
+/**
+ * single producer ring buffer, only its thread writes, trace_dump reads up to head
+*/
+struct TraceBuffer
+{
+    std::vector<TraceEvent> events;
+    std::atomic<std::uint64_t> head{0}; // number of events ever recorded
+    int tid;
+    TraceBuffer(const std::size_t capacity, const int tid): events(capacity), tid(tid) {}
+};
+
+std::mutex registry_mutex; // only taken the first time a thread records
+std::vector<std::unique_ptr<TraceBuffer>> registry; // buffers outlive their threads so they can be dumped
+std::size_t buffer_capacity = 1 << 20;
+std::chrono::steady_clock::time_point trace_start = std::chrono::steady_clock::now();
+
+TraceBuffer* thread_buffer() {
+    thread_local TraceBuffer* buffer = nullptr;
+    if(!buffer) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry.emplace_back(new TraceBuffer(buffer_capacity, (int)registry.size() + 1));
+        buffer = registry.back().get();
+    }
+    return buffer;
+}
+
+}
+
+void trace_enable(const TraceLevel level, const std::size_t capacity) {
+    buffer_capacity = capacity;
+    trace_start = std::chrono::steady_clock::now();
+    trace_level.store(level, std::memory_order_release);
+}
+
+std::uint64_t trace_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - trace_start).count();
+}
+
+void trace_record(const char* name, const std::uint64_t begin, const std::uint64_t end) {
+    TraceBuffer* buffer = thread_buffer();
+    std::uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    buffer->events[head % buffer->events.size()] = {name, begin, end};
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+bool trace_dump(const std::string& filepath) {
+    std::ofstream out(filepath);
+    if(!out.is_open()) {
+        std::cerr << "can't open trace file " << filepath << std::endl;
+        return false;
+    }
+    out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+    bool first = true;
+    std::size_t dropped = 0;
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for(const auto& buffer: registry) {
+        std::uint64_t head = buffer->head.load(std::memory_order_acquire);
+        std::uint64_t size = buffer->events.size();
+        std::uint64_t begin = head > size ? head - size : 0;
+        dropped += begin;
+        out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+            << ",\"args\":{\"name\":\"thread " << buffer->tid << "\"}}";
+        first = false;
+        for(std::uint64_t i = begin; i < head; i++) {
+            const TraceEvent& e = buffer->events[i % size];
+            out << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->tid
+                << ",\"ts\":" << e.begin / 1000.0 << ",\"dur\":" << (e.end - e.begin) / 1000.0 << "}";
+        }
+    }
+    out << "\n]}\n";
+    if(dropped) {
+        std::cerr << "trace: " << dropped << " oldest zones were overwritten, raise the ring buffer capacity" << std::endl;
+    }
+    return out.good();
+}
@@ -0,0 +1,65 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/**
+ * Timeline tracing in the Chrome trace-event format (opens in Perfetto or chrome://tracing).
+ * Zones are recorded into a ring buffer owned by the recording thread, without locks, and
+ * written out by trace_dump(). When tracing is off a zone costs one predictable branch.
+*/
+
+enum TraceLevel {
+    TRACE_OFF = 0,
+    TRACE_STAGES = 1, // loading, per model, per triangle and output zones
+    TRACE_FRAGMENTS = 2 // additionally one zone per fragment shader call, very verbose
+};
+
+extern std::atomic<int> trace_level;
+
+/**
+ * start recording zones up to level, each thread keeps the last capacity zones
+*/
+void trace_enable(const TraceLevel level, const std::size_t capacity = 1 << 20);
+
+/**
+ * write every recorded zone to a trace json file, call it once the traced threads are done
+*/
+bool trace_dump(const std::string& filepath);
+
+std::uint64_t trace_now(); // nanoseconds since trace_enable
+void trace_record(const char* name, const std::uint64_t begin, const std::uint64_t end);
+
+/**
+ * RAII zone, name must be a string literal (only the pointer is stored)
+*/
+class TraceZone
+{
+    const char* name;
+    std::uint64_t begin;
+    bool active;
+public:
+    TraceZone(const char* name, const int level = TRACE_STAGES)
+        :name(name), begin(0), active(trace_level.load(std::memory_order_relaxed) >= level) {
+        if(active) begin = trace_now();
+    }
+    ~TraceZone() {
+        end();
+    }
+    void end() { // close the zone before the end of its scope
+        if(active) trace_record(name, begin, trace_now());
+        active = false;
+    }
+    TraceZone(const TraceZone&) = delete;
+    TraceZone& operator=(const TraceZone&) = delete;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceZone TRACE_CONCAT(trace_zone_, __LINE__)(name)
+#define TRACE_SCOPE_FRAGMENT(name) TraceZone TRACE_CONCAT(trace_zone_, __LINE__)(name, TRACE_FRAGMENTS)
+
+#endif